@@ -1,7 +1,9 @@
 #pragma once
 
+#include <cassert>
 #include <iostream>
 #include <format>
+#include <span>
 #include <string>
 #include <string_view>
 #include <unordered_map>
@@ -52,6 +54,18 @@ public:
 		return m_cnt;
 	}
 
+	// each occurrence appends its values instead of replacing the previous ones
+	Arg & setRepeatable()
+	{
+		m_repeatable = true;
+		return *this;
+	}
+
+	bool isRepeatable() const
+	{
+		return m_repeatable;
+	}
+
 	std::string_view name() const
 	{
 		return m_name;
@@ -77,6 +91,7 @@ private:
 	bool m_required = true;
 	bool m_present = false;
 	unsigned m_cnt = 1;
+	bool m_repeatable = false;
 	std::vector<std::string> m_values;
 };
 
@@ -114,8 +129,9 @@ public:
 				return;
 			}
 
-			arg.valuesRef().resize(arg.count());
-			for (auto &v : arg.valuesRef()) {
+			size_t first = arg.isRepeatable() ? arg.valuesRef().size() : 0;
+			arg.valuesRef().resize(first + arg.count());
+			for (auto &v : std::span{arg.valuesRef()}.subspan(first)) {
 				v = argv[++i];
 				if (v[0] == v[v.size() - 1] && (v[0] == '\'' || v[0] == '"'))
 					v = v.substr(1, v.size() - 2);
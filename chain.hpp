@@ -0,0 +1,95 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "commands.hpp"
+#include "raster.hpp"
+#include "spool.hpp"
+
+
+// Chain printing a batch: consecutive labels that can share a cut go out as a chain, half cut from each other and fully
+// cut only after the last one, instead of every label being fed and cut as a job of its own.
+
+namespace bp {
+
+struct ChainGroup {
+	size_t first = 0;  // job
+	size_t jobs = 0;
+	unsigned labels = 0;  // pages, all copies of the jobs
+};
+
+// estimates for the P900 series, not measured: the leader is roughly the distance from the print head to the cutter,
+// the feed rate and cut times are guesses; only for reporting roughly what chaining saves
+struct ChainCosts {
+	static constexpr double LeaderMm = 25;  // fed ahead of the first label of a job, print head to cutter
+	static constexpr double FeedMmPerSecond = 20;
+	static constexpr double FullCutSeconds = 0.6;
+	static constexpr double HalfCutSeconds = 0.4;
+};
+
+static constexpr unsigned MaxChainLabels = 99;  // the most "cut each n labels" takes
+
+// labels on the same tape that are cut anyway and asked for half cuts can be chained, the others stay on their own
+inline bool chainable(const JobSettings &a, const JobSettings &b)
+{
+	return a.autoCut && b.autoCut && a.halfCut && b.halfCut && a.chainPrinting == b.chainPrinting && a.tapeWidth == b.tapeWidth
+		&& a.tapeType == b.tapeType;
+}
+
+// splits the jobs into runs of chainable ones, a job's copies are never split (a job with more copies than a chain can
+// have is a chain of its own, cut every MaxChainLabels)
+inline std::vector<ChainGroup> planChains(const std::vector<JobSettings> &jobs)
+{
+	std::vector<ChainGroup> groups;
+	for (size_t i = 0; i < jobs.size(); ++i) {
+		if (groups.empty() || !chainable(jobs[i - 1], jobs[i]) || groups.back().labels + jobs[i].copies > MaxChainLabels)
+			groups.push_back(ChainGroup{i, 0, 0});
+		++groups.back().jobs;
+		groups.back().labels += jobs[i].copies;
+	}
+	return groups;
+}
+
+// turns a page written by writePrintRequest into a label of a chain of the given length: fully cut after the chain's
+// last label (the half cuts in between are the page's own), error message if the page doesn't have the command to change
+inline std::string chainPage(uint8_t *page, size_t size, unsigned labels)
+{
+	for (size_t i = 0; i < size;) {
+		size_t n = commandSize(page, size, i);
+		if (n == 0 || page[i] == 'G' || page[i] == 'Z')
+			break;
+		if (page[i] == ESCAPE && n == sizeof(PageNumberInCutEachLabels) && page[i + 2] == 'A') {
+			page[i + offsetof(PageNumberInCutEachLabels, v)] = std::min(labels, MaxChainLabels);
+			return {};
+		}
+		i += n;
+	}
+	return "no cut settings ahead of the raster data";
+}
+
+struct ChainSavings {
+	double tapeMm = 0;
+	double seconds = 0;
+};
+
+// against printing every label as a job of its own: a leader and a full cut each, chained there is one leader and a
+// full cut per group, half cuts in between
+inline ChainSavings chainSavings(const std::vector<ChainGroup> &groups)
+{
+	unsigned labels = 0;
+	for (const auto &group : groups)
+		labels += group.labels;
+	if (labels == 0)
+		return {};
+
+	ChainSavings savings;
+	savings.tapeMm = (labels - 1) * ChainCosts::LeaderMm;
+	savings.seconds = savings.tapeMm / ChainCosts::FeedMmPerSecond + (labels - groups.size()) * (ChainCosts::FullCutSeconds - ChainCosts::HalfCutSeconds);
+	return savings;
+}
+
+}
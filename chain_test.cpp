@@ -0,0 +1,82 @@
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "chain.hpp"
+#include "commands.hpp"
+#include "raster.hpp"
+
+
+// a page as writePrintRequest starts it, up to the first raster line
+template <class... Commands>
+std::vector<uint8_t> page(const Commands &...commands)
+{
+	std::vector<uint8_t> data;
+	auto append = [&data](const auto &command) {
+		auto bytes = reinterpret_cast<const uint8_t *>(&command);
+		data.insert(data.end(), bytes, bytes + sizeof command);
+	};
+	(append(commands), ...);
+	data.push_back('Z');
+	return data;
+}
+
+// a job with half cut off is never chained, not even next to chainable ones
+void testHalfCutOffStaysAlone()
+{
+	JobSettings chainable;
+	chainable.tapeWidth = "12 mm";
+	JobSettings noHalfCut = chainable;
+	noHalfCut.halfCut = false;
+
+	auto groups = bp::planChains({chainable, chainable, noHalfCut, chainable});
+	assert(groups.size() == 3);
+	assert(groups[0].first == 0 && groups[0].jobs == 2 && groups[0].labels == 2);
+	assert(groups[1].first == 2 && groups[1].jobs == 1);
+	assert(groups[2].first == 3 && groups[2].jobs == 1);
+
+	assert(bp::planChains({noHalfCut, noHalfCut}).size() == 2);
+}
+
+// only labels that differ in chain printing are split
+void testChainPrintingHasToMatch()
+{
+	JobSettings a;
+	a.tapeWidth = "12 mm";
+	JobSettings b = a;
+	b.chainPrinting = true;
+
+	assert(bp::chainable(a, a));
+	assert(!bp::chainable(a, b));
+	assert(bp::planChains({a, b, b}).size() == 2);
+}
+
+// chainPage sets the labels per cut and leaves everything else, the half cut bit included, as rendered
+void testChainPageKeepsHalfCut()
+{
+	VariousModeSettings various;
+	various.v = VariousModeSettings::AutoCut;
+	AdvancedModeSettings advanced;
+	advanced.halfCut = false;
+	auto data = page(various, PageNumberInCutEachLabels{}, advanced);
+	auto before = data;
+
+	assert(bp::chainPage(data.data(), data.size(), 5).empty());
+	size_t changed = sizeof(VariousModeSettings) + offsetof(PageNumberInCutEachLabels, v);
+	assert(data[changed] == 5);
+	data[changed] = before[changed];
+	assert(data == before);
+
+	auto withoutCut = page(VariousModeSettings{});
+	assert(!bp::chainPage(withoutCut.data(), withoutCut.size(), 5).empty());
+}
+
+int main()
+{
+	testHalfCutOffStaysAlone();
+	testChainPrintingHasToMatch();
+	testChainPageKeepsHalfCut();
+	std::cout << "chain_test: ok\n";
+	return 0;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstdint>
+#include <ostream>
+
+
+const char ESCAPE = static_cast<char>(27);
+
+struct InitCommand {
+	const uint8_t invalidate[200] = {0};
+
+	const char m[2] = {ESCAPE, '@'};
+};
+
+struct StatusRequest {
+	const char v[3] = {ESCAPE, 'i', 'S'};
+};
+
+struct SwitchDynamicCommandMode {
+	const char m[3] = {ESCAPE, 'i', 'a'};
+
+	enum Mode : uint8_t {
+		EscP = 0x00,
+		Raster = 0x01,
+		PtouchTemplate = 0x03,
+	} v = Raster;
+};
+
+struct PrintInformationCommand {
+	const char m[3] = {ESCAPE, 'i', 'z'};
+
+	uint8_t usedFlags = 132;
+	uint8_t mediaType = 0;
+	uint8_t mediaWidth;
+	uint8_t mediaLength = 0;
+
+	uint8_t rasterNumber[4];
+
+	enum PageIndex : uint8_t {
+		Starting = 0,
+		Other = 1,
+		Last = 2,
+	} pageIndex = Last;
+
+	uint8_t unused = 0;
+
+	void setRasterNumber(uint32_t r)
+	{
+		for (unsigned i = 0; i < 4; ++i)
+			rasterNumber[i] = (r & (0xff << (i << 3))) >> (i << 3);
+	}
+};
+
+struct VariousModeSettings {
+	const char m[3] = {ESCAPE, 'i', 'M'};
+
+	enum Flags : uint8_t {
+		AutoCut = 0x40,
+		MirrorPrinting = 0x80,
+	};
+
+	uint8_t v = 0;
+};
+
+struct PageNumberInCutEachLabels {
+	const char m[3] = {ESCAPE, 'i', 'A'};
+	uint8_t v = 1;  // cut each label
+};
+
+struct AdvancedModeSettings {
+	const char m[3] = {ESCAPE, 'i', 'K'};
+	bool draftPrinting : 1 = false;
+	bool unused1 : 1 = false;
+	bool halfCut : 1 = true;
+	bool noChainPrinting : 1 = true;
+	bool specialTapeNoCutting : 1 = false;
+	bool unused2 : 1 = false;
+	bool highResolutionPrinting : 1 = false;
+	bool noBufferCleaningWhenPrinting : 1 = false;
+};
+
+struct SpecifyMarginAmount {
+	const char m[3] = {ESCAPE, 'i', 'd'};
+	uint8_t v[2] = {14, 0};
+};
+
+struct SelectCompressionMode {
+	enum Type : uint8_t {
+		NoCompression = 0x00,
+		Reserved = 0x01,  // disabled
+		Tiff = 0x02,
+	};
+
+	const char m = 'M';
+	uint8_t v = NoCompression;
+};
+
+template <class T>
+void writeStruct(std::ostream &out, const T &c)
+{
+	// for (size_t i = 0; i < sizeof(c); ++i)
+	// 	std::cerr << std::hex << std::setfill('0') << std::setw(2) << uint32_t(uint8_t(((char *)&c)[i]));
+	// std::cerr << "\n";
+	out.write(reinterpret_cast<const char *>(&c), sizeof(c));
+}
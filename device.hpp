@@ -0,0 +1,258 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <streambuf>
+#include <string>
+#include <string_view>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+
+namespace bp {
+
+static const std::string_view TcpPrefix = "tcp://";
+
+// "tcp://host:port" connects to the raw port of a network printer, anything else is opened as a file,
+// connecting gives up after connectTimeoutMs if that is set
+inline int openOutput(const std::string &path, int flags = O_WRONLY | O_APPEND | O_CREAT, int connectTimeoutMs = 0)
+{
+	if (!path.starts_with(TcpPrefix))
+		return ::open(path.c_str(), flags | O_CLOEXEC, 0644);
+
+	auto address = path.substr(TcpPrefix.size());
+	auto colon = address.rfind(':');
+	if (colon == std::string::npos) {
+		errno = EINVAL;
+		return -1;
+	}
+	auto host = address.substr(0, colon);
+	auto port = address.substr(colon + 1);
+
+	addrinfo hints{};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo *result = nullptr;
+	if (::getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0) {
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+
+	int fd = -1;
+	for (addrinfo *ai = result; ai; ai = ai->ai_next) {
+		fd = ::socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		timeval timeout{connectTimeoutMs / 1000, connectTimeoutMs % 1000 * 1000};
+		::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+		if (::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			timeval none{};
+			::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &none, sizeof none);
+			break;
+		}
+		::close(fd);
+		fd = -1;
+	}
+	::freeaddrinfo(result);
+
+	return fd;
+}
+
+inline bool writeAll(int fd, const void *data, size_t size)
+{
+	auto p = static_cast<const char *>(data);
+	while (size > 0) {
+		ssize_t n = ::write(fd, p, size);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+template <class T>
+bool writeStruct(int fd, const T &c)
+{
+	return writeAll(fd, &c, sizeof(c));
+}
+
+// copies [offset, offset + count) of in to out without passing the data through user space,
+// falls back to plain read/write if the kernel cannot sendfile between these two files
+inline bool sendFile(int out, int in, off_t offset, size_t count)
+{
+	while (count > 0) {
+		ssize_t n = ::sendfile(out, in, &offset, count);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EINVAL && errno != ENOSYS)
+				return false;
+			break;
+		}
+		if (n == 0) {
+			errno = EIO;  // file shorter than expected
+			return false;
+		}
+		count -= n;
+	}
+
+	char buf[1 << 16];
+	while (count > 0) {
+		ssize_t n = ::pread(in, buf, std::min(count, sizeof buf), offset);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		if (n == 0) {
+			errno = EIO;
+			return false;
+		}
+		if (!writeAll(out, buf, n))
+			return false;
+		offset += n;
+		count -= n;
+	}
+
+	return true;
+}
+
+inline off_t fileSize(int fd)
+{
+	struct stat st;
+	if (::fstat(fd, &st) < 0)
+		return -1;
+	return st.st_size;
+}
+
+// discards everything pending on the input without blocking, -1 on error
+inline int64_t drainInput(int fd)
+{
+	int flags = ::fcntl(fd, F_GETFL);
+	if (flags < 0 || (!(flags & O_NONBLOCK) && ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0))
+		return -1;
+
+	int64_t drained = 0;
+	char buf[4096];
+	for (;;) {
+		ssize_t n = ::read(fd, buf, sizeof buf);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				drained = -1;
+			break;
+		}
+		if (n == 0)
+			break;
+		drained += n;
+	}
+
+	int error = errno;
+	::fcntl(fd, F_SETFL, flags);
+	errno = error;
+	return drained;
+}
+
+// stream buffer that knows when all of its output has reached the destination
+class OutputBuf : public std::streambuf {
+public:
+	// writes out everything that is still pending, false (with errno set) if any of the output failed
+	virtual bool finish() = 0;
+};
+
+// output stream buffer over a raw descriptor, data reaches the descriptor on flush() or when the buffer fills up
+class FdBuf : public OutputBuf {
+public:
+	explicit FdBuf(int fd, bool owned = true) : m_fd(fd), m_owned(owned)
+	{
+		setp(m_buffer, m_buffer + sizeof m_buffer);
+	}
+
+	FdBuf(const FdBuf &) = delete;
+	FdBuf & operator=(const FdBuf &) = delete;
+
+	~FdBuf() override
+	{
+		sync();
+		if (m_owned && m_fd >= 0)
+			::close(m_fd);
+	}
+
+	int fd() const
+	{
+		return m_fd;
+	}
+
+	bool finish() override
+	{
+		return sync() == 0;
+	}
+
+protected:
+	// only reports the position (tellp), the number of bytes written through this buffer
+	pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override
+	{
+		if (off != 0 || dir != std::ios_base::cur || !(which & std::ios_base::out))
+			return pos_type(off_type(-1));
+		return pos_type(m_written + (pptr() - pbase()));
+	}
+
+	int_type overflow(int_type c) override
+	{
+		if (sync() < 0)
+			return traits_type::eof();
+		if (!traits_type::eq_int_type(c, traits_type::eof())) {
+			*pptr() = traits_type::to_char_type(c);
+			pbump(1);
+		}
+		return traits_type::not_eof(c);
+	}
+
+	std::streamsize xsputn(const char *s, std::streamsize n) override
+	{
+		if (n > epptr() - pptr()) {
+			if (sync() < 0)
+				return 0;
+			if (n > epptr() - pptr()) {
+				if (!writeAll(m_fd, s, n))
+					return 0;
+				m_written += n;
+				return n;
+			}
+		}
+		std::memcpy(pptr(), s, n);
+		pbump(n);
+		return n;
+	}
+
+	int sync() override
+	{
+		if (pptr() == pbase())
+			return 0;
+		bool ok = writeAll(m_fd, pbase(), pptr() - pbase());
+		m_written += pptr() - pbase();
+		setp(m_buffer, m_buffer + sizeof m_buffer);
+		return ok ? 0 : -1;
+	}
+
+private:
+	int m_fd;
+	bool m_owned;
+	off_type m_written = 0;
+	char m_buffer[1 << 16];
+};
+
+}
@@ -0,0 +1,252 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <glob.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "commands.hpp"
+#include "device.hpp"
+#include "json.hpp"
+#include "status.hpp"
+
+
+// Finds the printers attached to the host (/dev/usb/lp*) plus the configured network ones, asks all of them for their
+// status at the same time and keeps the answers in a small cache, so that routing a job doesn't need a status round trip.
+
+namespace bp {
+
+struct Printer {
+	std::string path;  // device or tcp://host:port
+	bool online = false;  // answered the status request
+	Status status{};
+	int64_t probedAt = 0;  // unix seconds
+	std::string error;  // why it is offline
+};
+
+inline int64_t unixNow()
+{
+	return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+inline std::vector<std::string> localPrinters(const char *pattern = "/dev/usb/lp*")
+{
+	std::vector<std::string> paths;
+	glob_t matches{};
+	if (::glob(pattern, 0, nullptr, &matches) == 0) {
+		for (size_t i = 0; i < matches.gl_pathc; ++i)
+			paths.push_back(matches.gl_pathv[i]);
+	}
+	::globfree(&matches);
+	return paths;
+}
+
+// requests the status and waits for the reply; whatever was queued in the device before (such as the reply to an earlier
+// request) is drained first, so the first reply is the one to this request
+inline Printer probePrinter(const std::string &path, std::chrono::milliseconds timeout)
+{
+	Printer printer;
+	printer.path = path;
+	printer.probedAt = unixNow();
+
+	auto deadline = std::chrono::steady_clock::now() + timeout;
+	int fd = openOutput(path, O_RDWR, timeout.count());
+	if (fd < 0) {
+		printer.error = std::strerror(errno);
+		return printer;
+	}
+
+	StatusFramer framer;
+	framer.subscribe([&printer](const Status &status) {
+		if (status.statusType == Status::StatusType::ReplyToStatusRequest) {
+			printer.status = status;
+			printer.online = true;
+		}
+	});
+
+	if (drainInput(fd) < 0 || !writeStruct(fd, StatusRequest{})) {
+		printer.error = std::strerror(errno);
+	} else {
+		while (!printer.online && pumpStatus(fd, framer, deadline));
+		if (!printer.online)
+			printer.error = errno == ETIMEDOUT ? "no status reply" : std::strerror(errno);
+	}
+	::close(fd);
+
+	return printer;
+}
+
+// one thread per printer, a slow or dead one only costs its own timeout
+inline std::vector<Printer> probePrinters(const std::vector<std::string> &paths, std::chrono::milliseconds timeout)
+{
+	std::vector<Printer> printers(paths.size());
+	std::vector<std::thread> threads;
+	threads.reserve(paths.size());
+	for (size_t i = 0; i < paths.size(); ++i)
+		threads.emplace_back([&printers, &paths, i, timeout] { printers[i] = probePrinter(paths[i], timeout); });
+	for (auto &thread : threads)
+		thread.join();
+	return printers;
+}
+
+// the whole of text as a number, false if it isn't one
+template <class T>
+bool parseNumber(std::string_view text, T &value, int base = 10)
+{
+	auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value, base);
+	return error == std::errc{} && end == text.data() + text.size();
+}
+
+// one printer per line: probedAt, path, status frame as hex or "-", error; lines that don't parse are skipped
+inline std::vector<Printer> readDiscoveryCache(const std::string &path)
+{
+	std::vector<Printer> printers;
+	std::ifstream in{path};
+	std::string line;
+	while (std::getline(in, line)) {
+		std::istringstream fields{line};
+		Printer printer;
+		std::string probedAt, frame;
+		if (!std::getline(fields, probedAt, '\t') || !std::getline(fields, printer.path, '\t') || !std::getline(fields, frame, '\t'))
+			continue;
+		std::getline(fields, printer.error);
+		if (!parseNumber(probedAt, printer.probedAt))
+			continue;
+		if (frame.size() == 2 * sizeof(Status)) {
+			auto bytes = reinterpret_cast<uint8_t *>(&printer.status);
+			size_t i = 0;
+			while (i < sizeof(Status) && parseNumber(std::string_view{frame}.substr(2 * i, 2), bytes[i], 16))
+				++i;
+			if (i < sizeof(Status))
+				continue;
+			printer.online = true;
+		} else if (frame != "-") {
+			continue;
+		}
+		printers.push_back(std::move(printer));
+	}
+	return printers;
+}
+
+// written to a temporary file of its own and renamed into place, so concurrent runs don't mix their answers
+inline std::string writeDiscoveryCache(const std::string &path, const std::vector<Printer> &printers)
+{
+	std::string data;
+	for (const auto &printer : printers) {
+		std::string frame = "-";
+		if (printer.online) {
+			frame.clear();
+			auto bytes = reinterpret_cast<const uint8_t *>(&printer.status);
+			for (size_t i = 0; i < sizeof(Status); ++i)
+				frame += std::format("{:02x}", bytes[i]);
+		}
+		data += std::format("{}\t{}\t{}\t{}\n", printer.probedAt, printer.path, frame, printer.error);
+	}
+
+	auto tmpPath = path + ".XXXXXX";
+	int fd = ::mkstemp(tmpPath.data());
+	if (fd < 0)
+		return std::format("failed to create '{}': {}", tmpPath, std::strerror(errno));
+	bool ok = ::fchmod(fd, 0644) == 0 && writeAll(fd, data.data(), data.size());
+	ok = ::close(fd) == 0 && ok;
+	if (!ok || ::rename(tmpPath.c_str(), path.c_str()) < 0) {
+		auto error = std::format("failed to write '{}': {}", path, std::strerror(errno));
+		::unlink(tmpPath.c_str());
+		return error;
+	}
+
+	return {};
+}
+
+// a printer that didn't answer is asked again after this at the latest, it may just have been switched on
+inline constexpr std::chrono::seconds OfflineTtl{5};
+
+// cached answers younger than ttl (OfflineTtl for printers that were offline) are used as they are, the rest is probed
+// again and the cache rewritten
+inline std::vector<Printer> discoverPrinters(const std::vector<std::string> &paths, std::chrono::milliseconds timeout,
+	const std::string &cachePath, std::chrono::seconds ttl)
+{
+	auto cached = cachePath.empty() ? std::vector<Printer>{} : readDiscoveryCache(cachePath);
+	int64_t now = unixNow();
+
+	std::vector<Printer> printers(paths.size());
+	std::vector<std::string> stale;
+	for (size_t i = 0; i < paths.size(); ++i) {
+		auto it = std::find_if(cached.begin(), cached.end(), [&](const Printer &p) { return p.path == paths[i]; });
+		if (it != cached.end() && now - it->probedAt < (it->online ? ttl : std::min(ttl, OfflineTtl)).count())
+			printers[i] = *it;
+		else
+			stale.push_back(paths[i]);
+	}
+
+	if (!stale.empty()) {
+		auto probed = probePrinters(stale, timeout);
+		for (auto &printer : probed) {
+			auto it = std::find(paths.begin(), paths.end(), printer.path);
+			printers[it - paths.begin()] = std::move(printer);
+		}
+		if (!cachePath.empty()) {
+			// printers probed by others stay in the cache
+			auto all = printers;
+			for (const auto &printer : cached) {
+				if (std::find(paths.begin(), paths.end(), printer.path) == paths.end())
+					all.push_back(printer);
+			}
+			writeDiscoveryCache(cachePath, all);
+		}
+	}
+
+	return printers;
+}
+
+inline void printPrinter(std::ostream &out, const Printer &printer, int64_t now)
+{
+	if (!printer.online) {
+		out << printer.path << ": offline (" << printer.error << ")\n";
+		return;
+	}
+	const auto &status = printer.status;
+	out << printer.path << ": " << status.modelCodeStr()
+		<< ", " << status.mediaWidthStr() << " " << status.mediaTypeStr()
+		<< ", " << status.textColourStr() << " on " << status.tapeColourStr()
+		<< ", " << (status.isReady() ? "ready" : status.errors().empty() ? std::string{status.phaseStr()} : status.errorStr())
+		<< " (" << now - printer.probedAt << " s ago)\n";
+}
+
+inline void printPrinterJson(std::ostream &out, const Printer &printer, int64_t now)
+{
+	{
+		JsonObjectWriter json{out};
+		json.field("path", printer.path)
+			.field("online", printer.online)
+			.field("age", now - printer.probedAt);
+		if (printer.online) {
+			const auto &status = printer.status;
+			json.field("model code", status.modelCodeStr())
+				.field("media width", status.mediaWidthStr())
+				.field("media type", status.mediaTypeStr())
+				.field("tape colour", status.tapeColourStr())
+				.field("text colour", status.textColourStr())
+				.array("errors", status.errors())
+				.field("ready", status.isReady());
+		} else {
+			json.field("error", printer.error);
+		}
+	}
+	out << "\n";
+}
+
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <format>
+#include <ostream>
+#include <string_view>
+
+#include "json.hpp"
+
+
+namespace bp {
+
+// HDR-style latency histogram in microseconds: exact below 16 us, then 16 linear sub-buckets per power of two
+// (about 6 % resolution). The counters are atomics that are valid when zeroed, so it can live in shared memory.
+class LatencyHistogram {
+public:
+	static const unsigned SubBucketBits = 4;
+	static const unsigned SubBuckets = 1 << SubBucketBits;
+	static const unsigned MaxMagnitude = 40;  // 2^40 us is about 12 days, longer values are clamped
+	static const unsigned Buckets = SubBuckets + (MaxMagnitude - SubBucketBits + 1) * SubBuckets;
+
+	static unsigned bucketOf(uint64_t us)
+	{
+		if (us < SubBuckets)
+			return us;
+		unsigned magnitude = std::bit_width(us) - 1;
+		if (magnitude > MaxMagnitude)
+			return Buckets - 1;
+		unsigned shift = magnitude - SubBucketBits;
+		return SubBuckets + shift * SubBuckets + static_cast<unsigned>((us >> shift) - SubBuckets);
+	}
+
+	// smallest value that falls into the bucket
+	static uint64_t lowerBound(unsigned bucket)
+	{
+		if (bucket < SubBuckets)
+			return bucket;
+		unsigned shift = (bucket - SubBuckets) / SubBuckets;
+		return static_cast<uint64_t>(SubBuckets + (bucket - SubBuckets) % SubBuckets) << shift;
+	}
+
+	static uint64_t upperBound(unsigned bucket)
+	{
+		return bucket + 1 < Buckets ? lowerBound(bucket + 1) - 1 : lowerBound(bucket);
+	}
+
+	void record(uint64_t us)
+	{
+		m_counts[bucketOf(us)].fetch_add(1, std::memory_order_relaxed);
+		m_total.fetch_add(1, std::memory_order_relaxed);
+		m_sum.fetch_add(us, std::memory_order_relaxed);
+		uint64_t max = m_max.load(std::memory_order_relaxed);
+		while (us > max && !m_max.compare_exchange_weak(max, us, std::memory_order_relaxed));
+	}
+
+	uint64_t count() const
+	{
+		return m_total.load(std::memory_order_relaxed);
+	}
+
+	uint64_t max() const
+	{
+		return m_max.load(std::memory_order_relaxed);
+	}
+
+	uint64_t mean() const
+	{
+		uint64_t total = count();
+		return total ? m_sum.load(std::memory_order_relaxed) / total : 0;
+	}
+
+	// upper bound of the bucket holding the given fraction (0..1) of the values
+	uint64_t percentile(double fraction) const
+	{
+		uint64_t total = count();
+		if (!total)
+			return 0;
+		uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(fraction * total + 0.5));
+		uint64_t seen = 0;
+		for (unsigned bucket = 0; bucket < Buckets; ++bucket) {
+			seen += m_counts[bucket].load(std::memory_order_relaxed);
+			if (seen >= rank)
+				return std::min(upperBound(bucket), max());
+		}
+		return max();
+	}
+
+private:
+	std::atomic<uint64_t> m_counts[Buckets];
+	std::atomic<uint64_t> m_total;
+	std::atomic<uint64_t> m_sum;
+	std::atomic<uint64_t> m_max;
+};
+
+inline void printHistogram(std::ostream &out, std::string_view name, const LatencyHistogram &histogram)
+{
+	auto ms = [](uint64_t us) { return std::format("{:.3f} ms", us / 1000.0); };
+	out << name << ": count " << histogram.count();
+	if (histogram.count()) {
+		out << ", mean " << ms(histogram.mean())
+			<< ", p50 " << ms(histogram.percentile(0.5))
+			<< ", p90 " << ms(histogram.percentile(0.9))
+			<< ", p99 " << ms(histogram.percentile(0.99))
+			<< ", max " << ms(histogram.max());
+	}
+	out << "\n";
+}
+
+inline void printHistogramJson(std::ostream &out, std::string_view name, const LatencyHistogram &histogram)
+{
+	{
+		JsonObjectWriter json{out};
+		json.field("name", name)
+			.field("count", histogram.count())
+			.field("mean_us", histogram.mean())
+			.field("p50_us", histogram.percentile(0.5))
+			.field("p90_us", histogram.percentile(0.9))
+			.field("p99_us", histogram.percentile(0.99))
+			.field("p999_us", histogram.percentile(0.999))
+			.field("max_us", histogram.max());
+	}
+	out << "\n";
+}
+
+}
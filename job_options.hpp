@@ -0,0 +1,156 @@
+#pragma once
+
+#include <format>
+#include <istream>
+#include <string>
+#include <vector>
+
+#include "ArgParser.hpp"
+#include "json.hpp"
+#include "raster.hpp"
+
+
+// the print options of make_request print, optional here except for the tape width (unless it may come from elsewhere)
+inline void addJobOptions(ArgParser &parser, bool tapeWidthRequired = true)
+{
+	parser.addArgument(Arg{"--copies"}.setOptional());
+	parser.addArgument(Arg{"--compression"}.setOptional());
+	parser.addArgument(Arg{"--tape-type"}.setOptional());
+	parser.addArgument(tapeWidthRequired ? Arg{"--tape-width"} : Arg{"--tape-width"}.setOptional());
+	parser.addArgument(Arg{"--set-length-margin"}.setOptional());
+	parser.addArgument(Arg{"--no-auto-cut"}.setOptional().setCount(0));
+	parser.addArgument(Arg{"--no-half-cut"}.setOptional().setCount(0));
+	parser.addArgument(Arg{"--chain-printing"}.setOptional().setCount(0));
+	parser.addArgument(Arg{"--mirror-printing"}.setOptional().setCount(0));
+	parser.addArgument(Arg{"--scale-down"}.setOptional().setCount(0));
+	parser.addArgument(Arg{"--scale-up"}.setOptional().setCount(0));
+	parser.addArgument(Arg{"--center"}.setOptional().setCount(0));
+}
+
+// options that aren't given keep the value settings already has, error message on invalid values
+inline std::string parseJobOptions(const ArgParser &parser, JobSettings &settings)
+{
+	if (parser.has("--copies"))
+		settings.copies = std::stoi(parser.value("--copies"));
+	if (parser.has("--compression")) {
+		if (parser.value("--compression") == "tiff")
+			settings.compressed = true;
+		else if (parser.value("--compression") == "no compression")
+			settings.compressed = false;
+		else
+			return std::format("Invalid compression mode: {}", parser.value("--compression"));
+	}
+	if (parser.has("--tape-type"))
+		settings.tapeType = parser.value("--tape-type");
+	if (parser.has("--tape-width"))
+		settings.tapeWidth = parser.value("--tape-width");
+	if (parser.has("--set-length-margin"))
+		settings.lengthMargin = std::stoi(parser.value("--set-length-margin"));
+	settings.autoCut = !parser.has("--no-auto-cut");
+	settings.halfCut = !parser.has("--no-half-cut");
+	settings.chainPrinting = parser.has("--chain-printing");
+	settings.mirrorPrinting = parser.has("--mirror-printing");
+	settings.scaleDown = parser.has("--scale-down");
+	settings.scaleUp = parser.has("--scale-up");
+	settings.center = parser.has("--center");
+
+	if (settings.copies == 0)
+		return "Invalid number of copies: 0";
+	return {};
+}
+
+// the same options as a JSON object, keys named after them: {"image": "cat.png", "copies": 2, "auto-cut": false}
+inline std::string parseJobObject(const bp::JsonObject &object, JobSettings &settings)
+{
+	for (const auto &[key, value] : object) {
+		using Type = bp::JsonValue::Type;
+		auto expected = [&](std::string_view type) { return std::format("Invalid value for '{}', expected {}", key, type); };
+
+		if (key == "image" || key == "tape-width" || key == "tape-type" || key == "tape-colour" || key == "text-colour"
+			|| key == "compression" || key == "output") {
+			if (value.type != Type::String)
+				return expected("a string");
+		} else if (key == "copies" || key == "length-margin") {
+			if (value.type != Type::Number || value.number < 0 || value.number != static_cast<unsigned>(value.number))
+				return expected("a whole number");
+		} else if (key == "auto-cut" || key == "half-cut" || key == "chain-printing" || key == "mirror-printing"
+			|| key == "scale-down" || key == "scale-up" || key == "center") {
+			if (value.type != Type::Bool)
+				return expected("true or false");
+		} else {
+			return std::format("Unknown key '{}'", key);
+		}
+
+		if (key == "image")
+			settings.image = value.string;
+		else if (key == "tape-width")
+			settings.tapeWidth = value.string;
+		else if (key == "tape-type")
+			settings.tapeType = value.string;
+		else if (key == "tape-colour")
+			settings.tapeColour = value.string;
+		else if (key == "text-colour")
+			settings.textColour = value.string;
+		else if (key == "compression" && value.string == "tiff")
+			settings.compressed = true;
+		else if (key == "compression" && value.string == "no compression")
+			settings.compressed = false;
+		else if (key == "compression")
+			return std::format("Invalid compression mode: {}", value.string);
+		else if (key == "copies")
+			settings.copies = value.number;
+		else if (key == "length-margin")
+			settings.lengthMargin = value.number;
+		else if (key == "auto-cut")
+			settings.autoCut = value.boolean;
+		else if (key == "half-cut")
+			settings.halfCut = value.boolean;
+		else if (key == "chain-printing")
+			settings.chainPrinting = value.boolean;
+		else if (key == "mirror-printing")
+			settings.mirrorPrinting = value.boolean;
+		else if (key == "scale-down")
+			settings.scaleDown = value.boolean;
+		else if (key == "scale-up")
+			settings.scaleUp = value.boolean;
+		else if (key == "center")
+			settings.center = value.boolean;
+	}
+
+	if (settings.image.empty())
+		return "No image";
+	if (settings.tapeWidth.empty())
+		return "No tape width";
+	if (settings.copies == 0)
+		return "Invalid number of copies: 0";
+	return {};
+}
+
+struct ManifestJob {
+	JobSettings settings;
+	std::string output;  // where the job goes on its own, empty for the default
+};
+
+// one job per line (JSON Lines), keys that a line leaves out keep the values of defaults, blank lines are skipped
+inline std::string readManifest(std::istream &in, const JobSettings &defaults, std::vector<ManifestJob> &jobs)
+{
+	std::string line;
+	bp::JsonObject object;
+	for (unsigned lineNr = 1; std::getline(in, line); ++lineNr) {
+		if (line.find_first_not_of(" \t\r") == std::string::npos)
+			continue;
+		if (auto error = bp::readJsonObject(line, object); !error.empty())
+			return std::format("line {}: {}", lineNr, error);
+
+		ManifestJob job{defaults, {}};
+		if (auto error = parseJobObject(object, job.settings); !error.empty())
+			return std::format("line {}: {}", lineNr, error);
+		if (auto it = object.find("output"); it != object.end())
+			job.output = it->second.string;
+		jobs.push_back(std::move(job));
+	}
+	if (in.bad())
+		return "Failed to read the manifest";
+
+	return {};
+}
@@ -0,0 +1,577 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <format>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "job_options.hpp"
+#include "json.hpp"
+#include "raster.hpp"
+#include "runner.hpp"
+
+
+// Takes print jobs over a Unix domain socket, so a program printing many labels pays one write per label instead of a
+// process. A connection sends any number of jobs, a frame each, and gets back an id for every job followed by its
+// events as they happen. Frames are in the host's byte order. An image can also be handed over as a descriptor (a
+// sealed memfd) sent along with its frame, which is mapped and rasterized where it is.
+
+namespace bp {
+
+// followed by optionsSize bytes of options and imageSize bytes of image, unless the image is shared
+struct JobRequestHeader {
+	enum Format : uint8_t {
+		Png,
+		Gray8,  // raw pixels, rows of width pixels stride bytes apart
+		Rgb8,
+		Rgba8,
+		Mono1,  // 8 pixels a byte, the first in the high bit, a set bit is black
+	};
+
+	enum Flags : uint8_t {
+		// the image is the first imageSize bytes of the descriptor sent with the frame's first byte (SCM_RIGHTS), a memfd
+		// sealed against shrinking, which the client doesn't change until the job completed or failed
+		SharedImage = 0x01,
+	};
+
+	char magic[4] = {'P', 'T', 'J', 'R'};
+	uint32_t optionsSize = 0;  // a JSON object with the keys of a manifest line, may be empty
+	uint32_t imageSize = 0;  // without image, the options name a file (or "test")
+	uint8_t format = Png;
+	uint8_t flags = 0;
+	uint8_t reserved[2] = {};
+	uint32_t width = 0;  // of raw pixels
+	uint32_t height = 0;
+	uint32_t stride = 0;
+};
+
+static_assert(sizeof(JobRequestHeader) == 28);
+
+// followed by messageSize bytes of error message
+struct JobEventHeader {
+	enum Event : uint8_t {
+		Queued,  // the first event of a job that was accepted, with its id
+		Rendering,
+		Sending,  // again if the job goes to another printer
+		Completed,
+		Error,  // the last event of a job that won't be printed, possibly the first
+	};
+
+	char magic[4] = {'P', 'T', 'J', 'E'};
+	uint32_t job = 0;
+	uint8_t event = Queued;
+	uint8_t reserved = 0;
+	uint16_t messageSize = 0;
+};
+
+static_assert(sizeof(JobEventHeader) == 12);
+
+// Reads jobs from the clients on one thread and prints them on another: whatever has been queued by the time the
+// scheduler is done with the previous jobs becomes its next run.
+class JobServer {
+public:
+	static constexpr uint32_t MaxOptionsSize = 64 << 10;
+	static constexpr uint32_t MaxImageSize = 64 << 20;
+	static constexpr size_t MaxPendingOutput = 1 << 20;  // events a client doesn't read before it is dropped
+	static constexpr size_t MaxDescriptors = 16;  // received with one frame
+
+	JobServer(JobScheduler &scheduler, JobSettings defaults, std::ostream &log)
+		: m_scheduler(scheduler), m_defaults(std::move(defaults)), m_log(log)
+	{
+		m_scheduler.setListener([this](size_t index, JobEvent event, std::string_view error) {
+			auto &job = *m_batch[index];
+			static const JobEventHeader::Event Events[] = {JobEventHeader::Rendering, JobEventHeader::Sending, JobEventHeader::Completed, JobEventHeader::Error};
+			job.done = job.done || event == JobEvent::Completed || event == JobEvent::Failed;
+			post(job.client, job.id, Events[static_cast<int>(event)], error);
+		});
+	}
+
+	JobServer(const JobServer &) = delete;
+	JobServer & operator=(const JobServer &) = delete;
+
+	~JobServer()
+	{
+		{
+			std::lock_guard lock{m_mutex};
+			m_stopping = true;
+		}
+		m_queued.notify_all();
+		if (m_printing.joinable())
+			m_printing.join();
+		for (auto &[id, client] : m_clients)
+			close(client);
+		if (m_listen >= 0) {
+			::close(m_listen);
+			::unlink(m_path.c_str());
+		}
+		if (m_wake >= 0)
+			::close(m_wake);
+	}
+
+	// error message if the socket can't be set up; a socket left behind by an earlier server is replaced
+	std::string listen(const std::string &path)
+	{
+		sockaddr_un address{};
+		address.sun_family = AF_UNIX;
+		if (path.size() >= sizeof address.sun_path)
+			return std::format("socket path '{}' is too long", path);
+		std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+		struct stat st;
+		if (::stat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+			::unlink(path.c_str());
+		m_listen = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (m_listen < 0 || ::bind(m_listen, reinterpret_cast<sockaddr *>(&address), sizeof address) < 0 || ::listen(m_listen, SOMAXCONN) < 0)
+			return std::format("failed to listen on '{}': {}", path, std::strerror(errno));
+		m_path = path;
+
+		m_wake = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (m_wake < 0)
+			return std::format("failed to create an eventfd: {}", std::strerror(errno));
+		m_printing = std::thread{[this] { print(); }};
+		return {};
+	}
+
+	// until stop is set, which is looked at every 200 ms
+	void serve(const volatile std::sig_atomic_t &stop)
+	{
+		std::vector<pollfd> fds;
+		std::vector<uint64_t> ids;
+		while (!stop) {
+			fds.assign({pollfd{m_listen, POLLIN, 0}, pollfd{m_wake, POLLIN, 0}});
+			ids.clear();
+			for (const auto &[id, client] : m_clients) {
+				fds.push_back(pollfd{client.fd, static_cast<short>((client.eof ? 0 : POLLIN) | (client.out.empty() ? 0 : POLLOUT)), 0});
+				ids.push_back(id);
+			}
+			if (::poll(fds.data(), fds.size(), 200) < 0) {
+				if (errno != EINTR)
+					m_log << std::format("poll failed: {}\n", std::strerror(errno));
+				continue;
+			}
+
+			if (fds[1].revents & POLLIN)
+				deliver();
+			if (fds[0].revents & POLLIN)
+				accept();
+			for (size_t i = 2; i < fds.size(); ++i) {
+				auto it = m_clients.find(ids[i - 2]);
+				if (it == m_clients.end())
+					continue;  // dropped while delivering
+				bool ok = true;
+				if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+					ok = receive(it->first, it->second);
+				// a client that hung up can't get events any more (and would wake poll() right away on every pass), its
+				// jobs are printed all the same
+				if (fds[i].revents & (POLLHUP | POLLERR))
+					ok = false;
+				if (ok && (fds[i].revents & POLLOUT))
+					ok = flush(it->second);
+				// a client that is done sending still gets the events of its jobs
+				if (!ok || (it->second.eof && it->second.jobs == 0 && it->second.out.empty())) {
+					close(it->second);
+					m_clients.erase(it);
+				}
+			}
+		}
+	}
+
+private:
+	struct Client {
+		explicit Client(int fd) : fd(fd)
+		{
+		}
+
+		int fd;
+		std::string in;  // the start of a frame
+		std::vector<int> fds;  // received with the frame being read
+		std::string out;  // events not written yet
+		size_t jobs = 0;  // accepted and not completed or failed yet
+		bool eof = false;  // sends no more jobs
+	};
+
+	// a shared image, mapped read-only for as long as its job lives
+	struct Mapping {
+		const uint8_t *data = nullptr;
+		size_t size = 0;
+
+		Mapping() = default;
+		Mapping(const Mapping &) = delete;
+		Mapping & operator=(const Mapping &) = delete;
+
+		~Mapping()
+		{
+			if (data)
+				::munmap(const_cast<uint8_t *>(data), size);
+		}
+	};
+
+	struct Job {
+		uint32_t id;
+		uint64_t client;
+		JobSettings settings;
+		JobRequestHeader header;
+		std::string image;  // sent in the frame, empty for a file or a shared image
+		Mapping shared;
+		bool done = false;  // reported as completed or failed
+
+		std::string_view pixels() const
+		{
+			return shared.data ? std::string_view{reinterpret_cast<const char *>(shared.data), shared.size} : std::string_view{image};
+		}
+	};
+
+	struct Event {
+		uint64_t client;
+		JobEventHeader header;
+		std::string message;
+	};
+
+	void accept()
+	{
+		for (;;) {
+			int fd = ::accept4(m_listen, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if (fd < 0) {
+				if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+					m_log << std::format("Failed to accept a connection: {}\n", std::strerror(errno));
+				return;
+			}
+			m_clients.emplace(++m_lastClient, Client{fd});
+		}
+	}
+
+	static void close(Client &client)
+	{
+		::close(client.fd);
+		for (int fd : client.fds)
+			::close(fd);
+	}
+
+	// takes every complete frame, false once the client is gone or broke the protocol; reads never go past the end of
+	// the frame being read, so a descriptor that comes along belongs to it
+	bool receive(uint64_t id, Client &client)
+	{
+		char buf[1 << 16];
+		alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MaxDescriptors)];
+		for (;;) {
+			JobRequestHeader header;
+			size_t size = sizeof header;
+			if (client.in.size() >= sizeof header) {
+				std::memcpy(&header, client.in.data(), sizeof header);
+				if (std::memcmp(header.magic, JobRequestHeader{}.magic, sizeof header.magic) != 0) {
+					m_log << std::format("client {}: not a job frame, disconnecting\n", id);
+					return false;
+				}
+				if (header.optionsSize > MaxOptionsSize || header.imageSize > MaxImageSize) {
+					m_log << std::format("client {}: frame of {} + {} bytes is too large, disconnecting\n", id, header.optionsSize, header.imageSize);
+					return false;
+				}
+				size += header.optionsSize + (header.flags & JobRequestHeader::SharedImage ? 0 : header.imageSize);
+			}
+			if (client.in.size() == size) {
+				takeFrame(id, client, header);
+				continue;
+			}
+
+			iovec iov{buf, std::min(sizeof buf, size - client.in.size())};
+			msghdr msg{};
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof control;
+			ssize_t n = ::recvmsg(client.fd, &msg, MSG_CMSG_CLOEXEC);
+			if (n < 0)
+				return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+			for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+				if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+					continue;
+				for (size_t i = 0; i < (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int); ++i) {
+					int fd;
+					std::memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof fd, sizeof fd);
+					client.fds.push_back(fd);
+				}
+			}
+			if ((msg.msg_flags & MSG_CTRUNC) || client.fds.size() > MaxDescriptors) {
+				m_log << std::format("client {}: too many descriptors with a frame, disconnecting\n", id);
+				return false;
+			}
+			if (n == 0) {
+				client.eof = true;
+				if (!client.in.empty()) {
+					m_log << std::format("client {}: connection closed inside a frame\n", id);
+					return false;
+				}
+				return true;
+			}
+			client.in.append(buf, n);
+		}
+	}
+
+	// the frame in client.in is complete; a shared image gets the first descriptor that came with it, the others are closed
+	void takeFrame(uint64_t id, Client &client, const JobRequestHeader &header)
+	{
+		int fd = -1;
+		for (int received : client.fds) {
+			if (fd < 0 && (header.flags & JobRequestHeader::SharedImage))
+				fd = received;
+			else
+				::close(received);
+		}
+		client.fds.clear();
+
+		auto options = std::string_view{client.in}.substr(sizeof header, header.optionsSize);
+		auto image = std::string_view{client.in}.substr(sizeof header + header.optionsSize);
+		submit(id, client, header, options, image, fd);
+		client.in.clear();
+	}
+
+	// takes over fd, the descriptor of a shared image or -1
+	void submit(uint64_t clientId, Client &client, const JobRequestHeader &header, std::string_view options, std::string_view image, int fd)
+	{
+		auto job = std::make_shared<Job>(++m_lastJob, clientId, m_defaults, header, std::string{image});
+		auto error = mapImage(*job, fd);
+		if (error.empty())
+			error = parseRequest(*job, options);
+		if (!error.empty()) {
+			append(client, job->id, JobEventHeader::Error, error);
+			return;
+		}
+		append(client, job->id, JobEventHeader::Queued, {});
+		++client.jobs;
+		{
+			std::lock_guard lock{m_mutex};
+			m_queue.push_back(std::move(job));
+		}
+		m_queued.notify_one();
+	}
+
+	// error message if the shared image can't be mapped, takes over fd
+	static std::string mapImage(Job &job, int fd)
+	{
+		if (!(job.header.flags & JobRequestHeader::SharedImage))
+			return {};
+		if (fd < 0)
+			return "No descriptor sent for the shared image";
+
+		std::string error;
+		struct stat st;
+		void *data = MAP_FAILED;
+		if (job.header.format == JobRequestHeader::Png)
+			error = "A shared image has to be raw pixels";
+		else if (job.header.imageSize == 0)
+			error = "Empty shared image";
+		// without the seal, a client truncating the file would crash the server reading the mapping (SIGBUS)
+		else if (int seals = ::fcntl(fd, F_GET_SEALS); seals < 0 || !(seals & F_SEAL_SHRINK))
+			error = "The shared image has to be a memfd sealed with F_SEAL_SHRINK";
+		else if (::fstat(fd, &st) < 0)
+			error = std::format("Failed to stat the shared image: {}", std::strerror(errno));
+		else if (static_cast<uint64_t>(st.st_size) < job.header.imageSize)
+			error = std::format("Shared image of {} bytes is smaller than {} bytes", st.st_size, job.header.imageSize);
+		else if ((data = ::mmap(nullptr, job.header.imageSize, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+			error = std::format("Failed to map the shared image: {}", std::strerror(errno));
+		::close(fd);
+		if (!error.empty())
+			return error;
+
+		job.shared.data = static_cast<const uint8_t *>(data);
+		job.shared.size = job.header.imageSize;
+		return {};
+	}
+
+	// error message if the job can't be printed as it was sent
+	static std::string parseRequest(Job &job, std::string_view options)
+	{
+		auto pixels = job.pixels();
+		if (!pixels.empty())
+			job.settings.image = std::format("#{}", job.id);
+		if (!options.empty()) {
+			JsonObject object;
+			if (auto error = readJsonObject(std::string{options}, object); !error.empty())
+				return error;
+			if (!pixels.empty())
+				object.erase("image");
+			if (auto error = parseJobObject(object, job.settings); !error.empty())
+				return error;
+		} else if (job.settings.image.empty()) {
+			return "No image";
+		} else if (job.settings.tapeWidth.empty()) {
+			return "No tape width";
+		}
+
+		const auto &h = job.header;
+		if (h.format == JobRequestHeader::Png)
+			return {};
+		if (!margins().contains(job.settings.tapeWidth))
+			return std::format("Unrecognised tape width {}", job.settings.tapeWidth);
+		if (h.format > JobRequestHeader::Mono1)
+			return std::format("Unknown image format {}", h.format);
+		size_t rowSize = PixelView::rowSize(static_cast<PixelView::Format>(h.format - 1), h.width);
+		if (h.width == 0 || h.height == 0 || h.stride < rowSize)
+			return std::format("Invalid image of {}x{} pixels, {} bytes per row", h.width, h.height, h.stride);
+		// raw pixels aren't scaled
+		if (unsigned tapeHeight = Margins{job.settings.tapeWidth}.height; h.height > tapeHeight)
+			return std::format("Image of {} pixels across the tape, {} fit on {}", h.height, tapeHeight, job.settings.tapeWidth);
+		if (pixels.size() < uint64_t{h.stride} * (h.height - 1) + rowSize)
+			return std::format("{} bytes are too few for {}x{} pixels, {} bytes per row", pixels.size(), h.width, h.height, h.stride);
+		return {};
+	}
+
+	RenderedJob render(const Job &job, size_t index) const
+	{
+		if (job.pixels().empty())
+			return m_scheduler.render(job.settings, index);
+
+		RenderedJob rendered;
+		rendered.index = index;
+		rendered.name = job.settings.image;
+		rendered.settings = job.settings;
+		rendered.pages = job.settings.copies;
+		auto start = std::chrono::steady_clock::now();
+
+		const auto &h = job.header;
+		if (h.format == JobRequestHeader::Png) {
+			std::istringstream in{job.image};
+			png::image<png::rgb_pixel> image;
+			unsigned imageWidth;
+			uint8_t flags;
+			if (auto exec = loadImage(job.settings, image, imageWidth, flags, &in); !exec) {
+				rendered.error = exec.error;
+				return rendered;
+			}
+			renderImage(rendered, job.settings, image, imageWidth, flags);
+		} else {
+			// read where they are, no copy and no scaling
+			PixelView pixels{reinterpret_cast<const uint8_t *>(job.pixels().data()), h.width, h.height, h.stride, static_cast<PixelView::Format>(h.format - 1)};
+			renderImage(rendered, job.settings, pixels, h.width, jobFlags(job.settings));
+		}
+		rendered.renderTime = std::chrono::steady_clock::now() - start;
+		return rendered;
+	}
+
+	// the printing thread
+	void print()
+	{
+		for (;;) {
+			{
+				std::unique_lock lock{m_mutex};
+				m_queued.wait(lock, [this] { return m_stopping || !m_queue.empty(); });
+				if (m_stopping)
+					return;
+				m_batch.assign(m_queue.begin(), m_queue.end());
+				m_queue.clear();
+			}
+
+			auto error = m_scheduler.run(m_batch.size(), [this](size_t i) { return render(*m_batch[i], i); }, m_log);
+			for (const auto &job : m_batch) {
+				if (!job->done)
+					post(job->client, job->id, JobEventHeader::Error, error.empty() ? "Not printed" : error);
+			}
+		}
+	}
+
+	// from the printing threads
+	void post(uint64_t client, uint32_t job, JobEventHeader::Event event, std::string_view message)
+	{
+		{
+			std::lock_guard lock{m_mutex};
+			JobEventHeader header;
+			header.job = job;
+			header.event = event;
+			m_events.push_back(Event{client, header, std::string{message}});
+		}
+		uint64_t one = 1;
+		if (::write(m_wake, &one, sizeof one) < 0 && errno != EAGAIN)
+			m_log << std::format("Failed to wake the server: {}\n", std::strerror(errno));
+	}
+
+	// hands the posted events to their clients, the ones of a client that went away are dropped
+	void deliver()
+	{
+		uint64_t count;
+		if (::read(m_wake, &count, sizeof count) < 0 && errno != EAGAIN)
+			m_log << std::format("Failed to read the eventfd: {}\n", std::strerror(errno));
+		std::vector<Event> events;
+		{
+			std::lock_guard lock{m_mutex};
+			events.swap(m_events);
+		}
+		for (const auto &event : events) {
+			auto it = m_clients.find(event.client);
+			if (it == m_clients.end())
+				continue;
+			append(it->second, event.header.job, static_cast<JobEventHeader::Event>(event.header.event), event.message);
+			if (event.header.event == JobEventHeader::Completed || event.header.event == JobEventHeader::Error)
+				--it->second.jobs;
+			if (!flush(it->second)) {
+				close(it->second);
+				m_clients.erase(it);
+			}
+		}
+	}
+
+	static void append(Client &client, uint32_t job, JobEventHeader::Event event, std::string_view message)
+	{
+		JobEventHeader header;
+		header.job = job;
+		header.event = event;
+		message = message.substr(0, UINT16_MAX);
+		header.messageSize = message.size();
+		client.out.append(reinterpret_cast<const char *>(&header), sizeof header);
+		client.out.append(message);
+	}
+
+	// writes what the socket takes, false once the client is gone or doesn't keep up
+	static bool flush(Client &client)
+	{
+		while (!client.out.empty()) {
+			ssize_t n = ::send(client.fd, client.out.data(), client.out.size(), MSG_NOSIGNAL);
+			if (n < 0)
+				return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) && client.out.size() <= MaxPendingOutput;
+			client.out.erase(0, n);
+		}
+		return true;
+	}
+
+	JobScheduler &m_scheduler;
+	JobSettings m_defaults;
+	std::ostream &m_log;
+	std::string m_path;
+	int m_listen = -1;
+	int m_wake = -1;  // eventfd, for the printing threads to wake the main one
+	std::map<uint64_t, Client> m_clients;  // by an id that isn't reused, unlike the descriptor
+	uint64_t m_lastClient = 0;
+	uint32_t m_lastJob = 0;
+
+	std::mutex m_mutex;
+	std::condition_variable m_queued;
+	std::deque<std::shared_ptr<Job>> m_queue;
+	std::vector<Event> m_events;
+	bool m_stopping = false;
+
+	std::vector<std::shared_ptr<Job>> m_batch;  // of the current run, only touched by the printing thread and the listener
+	std::thread m_printing;
+};
+
+}
@@ -0,0 +1,243 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <format>
+#include <functional>
+#include <map>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+
+namespace bp {
+
+inline void writeJsonString(std::ostream &out, std::string_view str)
+{
+	out << '"';
+	for (char c : str) {
+		switch (c) {
+			case '"': out << "\\\""; break;
+			case '\\': out << "\\\\"; break;
+			case '\n': out << "\\n"; break;
+			case '\t': out << "\\t"; break;
+			default:
+				if (static_cast<uint8_t>(c) < 0x20)
+					out << std::format("\\u{:04x}", static_cast<unsigned>(c));
+				else
+					out << c;
+		}
+	}
+	out << '"';
+}
+
+// writes a flat JSON object on one line, values are added with field()
+class JsonObjectWriter {
+public:
+	explicit JsonObjectWriter(std::ostream &out) : m_out(out)
+	{
+		m_out << '{';
+	}
+
+	JsonObjectWriter(const JsonObjectWriter &) = delete;
+	JsonObjectWriter & operator=(const JsonObjectWriter &) = delete;
+
+	~JsonObjectWriter()
+	{
+		m_out << '}';
+	}
+
+	JsonObjectWriter & field(std::string_view key, std::string_view value)
+	{
+		writeKey(key);
+		writeJsonString(m_out, value);
+		return *this;
+	}
+
+	JsonObjectWriter & field(std::string_view key, const char *value)
+	{
+		return field(key, std::string_view{value});
+	}
+
+	JsonObjectWriter & field(std::string_view key, bool value)
+	{
+		writeKey(key);
+		m_out << (value ? "true" : "false");
+		return *this;
+	}
+
+	template <class T>
+	requires std::is_arithmetic_v<T>
+	JsonObjectWriter & field(std::string_view key, T value)
+	{
+		writeKey(key);
+		m_out << +value;
+		return *this;
+	}
+
+	template <class Range>
+	JsonObjectWriter & array(std::string_view key, const Range &values)
+	{
+		writeKey(key);
+		m_out << '[';
+		bool first = true;
+		for (const auto &value : values) {
+			if (!first)
+				m_out << ',';
+			writeJsonString(m_out, value);
+			first = false;
+		}
+		m_out << ']';
+		return *this;
+	}
+
+private:
+	void writeKey(std::string_view key)
+	{
+		if (!m_first)
+			m_out << ',';
+		writeJsonString(m_out, key);
+		m_out << ':';
+		m_first = false;
+	}
+
+	std::ostream &m_out;
+	bool m_first = true;
+};
+
+struct JsonValue {
+	enum class Type {
+		Null,
+		Bool,
+		Number,
+		String,
+	} type = Type::Null;
+
+	bool boolean = false;
+	double number = 0;
+	std::string string;
+};
+
+using JsonObject = std::map<std::string, JsonValue, std::less<>>;
+
+// reads a flat JSON object such as a line written by JsonObjectWriter (arrays and nested objects aren't supported),
+// error message on invalid input
+inline std::string readJsonObject(std::string_view text, JsonObject &object)
+{
+	size_t pos = 0;
+	auto skipSpace = [&] {
+		while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\r' || text[pos] == '\n'))
+			++pos;
+	};
+	auto expect = [&](char c) {
+		skipSpace();
+		if (pos < text.size() && text[pos] == c) {
+			++pos;
+			return true;
+		}
+		return false;
+	};
+	auto error = [&](std::string_view what) {
+		return std::format("{} at column {}", what, pos + 1);
+	};
+
+	auto readString = [&](std::string &str) {
+		if (!expect('"'))
+			return false;
+		str.clear();
+		while (pos < text.size() && text[pos] != '"') {
+			char c = text[pos++];
+			if (c != '\\') {
+				str += c;
+				continue;
+			}
+			if (pos == text.size())
+				return false;
+			switch (c = text[pos++]) {
+				case 'b': str += '\b'; break;
+				case 'f': str += '\f'; break;
+				case 'n': str += '\n'; break;
+				case 'r': str += '\r'; break;
+				case 't': str += '\t'; break;
+				case 'u': {
+					if (pos + 4 > text.size())
+						return false;
+					char *end;
+					std::string hex{text.substr(pos, 4)};
+					unsigned code = std::strtoul(hex.c_str(), &end, 16);
+					if (end != hex.c_str() + 4)
+						return false;
+					pos += 4;
+					// surrogate pairs aren't combined, nothing this reads needs them
+					if (code < 0x80) {
+						str += static_cast<char>(code);
+					} else if (code < 0x800) {
+						str += static_cast<char>(0xc0 | code >> 6);
+						str += static_cast<char>(0x80 | (code & 0x3f));
+					} else {
+						str += static_cast<char>(0xe0 | code >> 12);
+						str += static_cast<char>(0x80 | (code >> 6 & 0x3f));
+						str += static_cast<char>(0x80 | (code & 0x3f));
+					}
+					break;
+				}
+				default: str += c;
+			}
+		}
+		return expect('"');
+	};
+
+	object.clear();
+	if (!expect('{'))
+		return error("expected '{'");
+	if (expect('}')) {
+		skipSpace();
+		return pos == text.size() ? std::string{} : error("trailing characters");
+	}
+
+	do {
+		std::string key;
+		if (!readString(key))
+			return error("expected a key");
+		if (!expect(':'))
+			return error("expected ':'");
+
+		JsonValue value;
+		skipSpace();
+		auto rest = text.substr(pos);
+		if (rest.starts_with('"')) {
+			value.type = JsonValue::Type::String;
+			if (!readString(value.string))
+				return error("unterminated string");
+		} else if (rest.starts_with("true") || rest.starts_with("false")) {
+			value.type = JsonValue::Type::Bool;
+			value.boolean = rest.starts_with("true");
+			pos += value.boolean ? 4 : 5;
+		} else if (rest.starts_with("null")) {
+			pos += 4;
+		} else if (!rest.empty() && (rest[0] == '-' || (rest[0] >= '0' && rest[0] <= '9'))) {
+			std::string number{rest.substr(0, rest.find_first_of(",} \t\r\n"))};
+			char *end;
+			value.type = JsonValue::Type::Number;
+			value.number = std::strtod(number.c_str(), &end);
+			if (end != number.c_str() + number.size())
+				return error("invalid number");
+			pos += number.size();
+		} else if (rest.starts_with('{') || rest.starts_with('[')) {
+			return error("nested values are not supported");
+		} else {
+			return error("expected a value");
+		}
+		object[std::move(key)] = std::move(value);
+	} while (expect(','));
+
+	if (!expect('}'))
+		return error("expected ',' or '}'");
+	skipSpace();
+	if (pos != text.size())
+		return error("trailing characters");
+	return {};
+}
+
+}
@@ -0,0 +1,209 @@
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <format>
+#include <sstream>
+#include <string>
+
+#include "commands.hpp"
+#include "constants.hpp"
+#include "device.hpp"
+#include "ptouch.h"
+#include "raster.hpp"
+#include "status.hpp"
+
+static_assert(sizeof(Status) == PTOUCH_STATUS_SIZE);
+
+
+namespace {
+
+thread_local std::string lastError;
+
+int fail(std::string error)
+{
+	lastError = std::move(error);
+	return -1;
+}
+
+// everything but the image, which the caller hands over as pixels
+Exec prepare(const ptouch_job *job, const ptouch_pixels *pixels, JobSettings &settings, PixelView &view, unsigned &imageWidth, uint8_t &flags)
+{
+	if (!job || !job->tape_width)
+		return Exec{"no job or tape width"};
+	settings.tapeWidth = job->tape_width;
+	settings.copies = job->copies;
+	settings.lengthMargin = job->length_margin;
+	settings.compressed = job->compressed;
+	settings.autoCut = job->auto_cut;
+	settings.halfCut = job->half_cut;
+	settings.chainPrinting = job->chain_printing;
+	settings.mirrorPrinting = job->mirror_printing;
+	settings.center = job->center;
+	if (settings.copies == 0)
+		return Exec{"Invalid number of copies: 0"};
+	if (!bp::margins().contains(settings.tapeWidth))
+		return Exec{std::format("unrecognised media width {}", settings.tapeWidth)};
+
+	flags = jobFlags(settings);
+	view = PixelView{};
+	if (job->test_page) {
+		flags |= Flags::Test;
+		imageWidth = TestImageWidth;
+		return Exec{};
+	}
+
+	if (!pixels || !pixels->data)
+		return Exec{"no pixels"};
+	if (pixels->format != PTOUCH_GRAY8 && pixels->format != PTOUCH_RGB8 && pixels->format != PTOUCH_RGBA8 && pixels->format != PTOUCH_MONO1)
+		return Exec{std::format("unrecognised pixel format {}", pixels->format)};
+	if (pixels->width == 0 || pixels->height == 0)
+		return Exec{std::format("Invalid image of {}x{} pixels, {} bytes per row", pixels->width, pixels->height, pixels->stride)};
+	if (pixels->stride < PixelView::rowSize(static_cast<PixelView::Format>(pixels->format), pixels->width))
+		return Exec{std::format("stride {} is less than a row of {} pixels", pixels->stride, pixels->width)};
+	if (unsigned tapeHeight = Margins{settings.tapeWidth}.height; pixels->height > tapeHeight)
+		return Exec{std::format("image of {} pixels across the tape, {} fit on {}", pixels->height, tapeHeight, settings.tapeWidth)};
+
+	view.data = pixels->data;
+	view.width = pixels->width;
+	view.height = pixels->height;
+	view.stride = pixels->stride;
+	view.format = static_cast<PixelView::Format>(pixels->format);
+	imageWidth = pixels->width;
+	return Exec{};
+}
+
+Exec render(std::ostream &out, const ptouch_job *job, const ptouch_pixels *pixels)
+{
+	JobSettings settings;
+	PixelView view;
+	unsigned imageWidth;
+	uint8_t flags;
+	if (auto exec = prepare(job, pixels, settings, view, imageWidth, flags); !exec)
+		return exec;
+	return writePrintRequest(out, settings, view, imageWidth, flags);
+}
+
+template <class T>
+size_t copyCommand(uint8_t *buffer, size_t size)
+{
+	if (buffer && size >= sizeof(T)) {
+		T command;
+		std::memcpy(buffer, &command, sizeof command);
+	}
+	return sizeof(T);
+}
+
+template <size_t N>
+void copyString(char (&to)[N], std::string_view from)
+{
+	size_t n = std::min(from.size(), N - 1);
+	std::memcpy(to, from.data(), n);
+	to[n] = '\0';
+}
+
+}
+
+extern "C" {
+
+const char *ptouch_last_error(void)
+{
+	return lastError.c_str();
+}
+
+void ptouch_job_init(ptouch_job *job)
+{
+	JobSettings defaults;
+	*job = ptouch_job{};
+	job->copies = defaults.copies;
+	job->length_margin = defaults.lengthMargin;
+	job->compressed = defaults.compressed;
+	job->auto_cut = defaults.autoCut;
+	job->half_cut = defaults.halfCut;
+}
+
+int ptouch_tape_height(const char *tape_width)
+{
+	if (!tape_width || !bp::margins().contains(tape_width))
+		return fail(std::format("unrecognised media width {}", tape_width ? tape_width : "(null)"));
+	return Margins{tape_width}.height;
+}
+
+int ptouch_render(const ptouch_job *job, const ptouch_pixels *pixels, uint8_t **data, size_t *size)
+{
+	try {
+		std::ostringstream out;
+		if (auto exec = render(out, job, pixels); !exec)
+			return fail(exec.error);
+
+		auto request = std::move(out).str();
+		*data = static_cast<uint8_t *>(std::malloc(request.size()));
+		if (!*data)
+			return fail("out of memory");
+		std::memcpy(*data, request.data(), request.size());
+		*size = request.size();
+		return 0;
+	} catch (const std::exception &e) {
+		return fail(e.what());
+	}
+}
+
+int ptouch_render_fd(const ptouch_job *job, const ptouch_pixels *pixels, int fd)
+{
+	try {
+		bp::FdBuf buf{fd, false};
+		std::ostream out{&buf};
+		if (auto exec = render(out, job, pixels); !exec)
+			return fail(exec.error);
+		if (!buf.finish())
+			return fail(std::format("failed to write: {}", std::strerror(errno)));
+		return 0;
+	} catch (const std::exception &e) {
+		return fail(e.what());
+	}
+}
+
+void ptouch_free(void *data)
+{
+	std::free(data);
+}
+
+size_t ptouch_init_command(uint8_t *buffer, size_t size)
+{
+	return copyCommand<InitCommand>(buffer, size);
+}
+
+size_t ptouch_status_request(uint8_t *buffer, size_t size)
+{
+	return copyCommand<StatusRequest>(buffer, size);
+}
+
+int ptouch_decode_status(const uint8_t *frame, size_t size, ptouch_status *status)
+{
+	if (!frame || size != sizeof(Status))
+		return fail(std::format("a status frame has {} bytes, not {}", sizeof(Status), size));
+
+	Status s;
+	std::memcpy(&s, frame, sizeof s);
+	if (std::memcmp(frame, StatusFramer::Header, sizeof StatusFramer::Header) != 0)
+		return fail("not a status frame");
+
+	*status = ptouch_status{};
+	status->status_type = static_cast<int>(s.statusType);
+	status->phase_type = s.phaseType;
+	status->notification = static_cast<int>(s.notificationNumber);
+	status->error_bits = s.errorBits();
+	status->ready = s.isReady();
+	copyString(status->model, s.modelCodeStr());
+	copyString(status->battery_level, s.batteryLevelStr());
+	copyString(status->errors, s.errorStr());
+	copyString(status->media_width, s.mediaWidthStr());
+	copyString(status->media_type, s.mediaTypeStr());
+	copyString(status->status, s.statusStr());
+	copyString(status->phase, s.phaseStr());
+	copyString(status->notification_name, s.notificationStr());
+	copyString(status->tape_colour, s.tapeColourStr());
+	copyString(status->text_colour, s.textColourStr());
+	return 0;
+}
+
+}
@@ -3,419 +3,283 @@
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <memory>
 #include <random>
+#include <sstream>
+#include <thread>
 
 #include "ArgParser.hpp"
-#include "constants.hpp"
-#include "scaling.hpp"
-
-
-const char ESCAPE = static_cast<char>(27);
-
-struct InitCommand {
-	const uint8_t invalidate[200] = {0};
-
-	const char m[2] = {ESCAPE, '@'};
-};
-
-struct StatusRequest {
-	const char v[3] = {ESCAPE, 'i', 'S'};
-};
-
-struct SwitchDynamicCommandMode {
-	const char m[3] = {ESCAPE, 'i', 'a'};
-
-	enum Mode : uint8_t {
-		EscP = 0x00,
-		Raster = 0x01,
-		PtouchTemplate = 0x03,
-	} v = Raster;
-};
-
-struct PrintInformationCommand {
-	const char m[3] = {ESCAPE, 'i', 'z'};
-
-	uint8_t usedFlags = 132;
-	uint8_t mediaType = 0;
-	uint8_t mediaWidth;
-	uint8_t mediaLength = 0;
-
-	uint8_t rasterNumber[4];
-
-	enum PageIndex : uint8_t {
-		Starting = 0,
-		Other = 1,
-		Last = 2,
-	} pageIndex = Last;
-
-	uint8_t unused = 0;
-
-	void setRasterNumber(uint32_t r)
-	{
-		for (unsigned i = 0; i < 4; ++i)
-			rasterNumber[i] = (r & (0xff << (i << 3))) >> (i << 3);
-	}
-};
-
-struct VariousModeSettings {
-	const char m[3] = {ESCAPE, 'i', 'M'};
-
-	enum Flags : uint8_t {
-		AutoCut = 0x40,
-		MirrorPrinting = 0x80,
-	};
+#include "chain.hpp"
+#include "commands.hpp"
+#include "device.hpp"
+#include "job_options.hpp"
+#include "pipeline.hpp"
+#include "raster.hpp"
+#include "render_cache.hpp"
+#include "sender.hpp"
+#include "spool.hpp"
+#include "status_shm.hpp"
+#include "worker_pool.hpp"
+
+
+// lets status_daemon --shm time the job from its last byte to "printing completed", the job is fine without it
+static void markJobWritten(const std::string &shmName)
+{
+	if (!bp::markJobWritten(shmName))
+		std::cerr << "Failed to mark job in shared memory '" << shmName << "': " << std::strerror(errno) << "\n";
+}
 
-	uint8_t v = 0;
-};
-
-struct PageNumberInCutEachLabels {
-	const char m[3] = {ESCAPE, 'i', 'A'};
-	uint8_t v = 1;  // cut each label
-};
-
-struct AdvancedModeSettings {
-	const char m[3] = {ESCAPE, 'i', 'K'};
-	bool draftPrinting : 1 = false;
-	bool unused1 : 1 = false;
-	bool halfCut : 1 = true;
-	bool noChainPrinting : 1 = true;
-	bool specialTapeNoCutting : 1 = false;
-	bool unused2 : 1 = false;
-	bool highResolutionPrinting : 1 = false;
-	bool noBufferCleaningWhenPrinting : 1 = false;
-};
-
-struct SpecifyMarginAmount {
-	const char m[3] = {ESCAPE, 'i', 'd'};
-	uint8_t v[2] = {14, 0};
-};
-
-struct SelectCompressionMode {
-	enum Type : uint8_t {
-		NoCompression = 0x00,
-		Reserved = 0x01,  // disabled
-		Tiff = 0x02,
+// sends the preamble and the job (or a single page of it) with a MonitoredSender, the error says how far it got
+static std::string sendMonitored(int out, int in, off_t size, const bp::SpoolPage *page, const ArgParser &parser, std::chrono::milliseconds resumeTimeout)
+{
+	if (size <= 0)
+		return size < 0 ? std::strerror(errno) : "empty job";
+	void *data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, in, 0);
+	if (data == MAP_FAILED)
+		return std::format("failed to map: {}", std::strerror(errno));
+	::madvise(data, size, MADV_SEQUENTIAL);
+
+	std::vector<uint8_t> preamble;
+	auto append = [](std::vector<uint8_t> &buf, const auto &command) {
+		auto bytes = reinterpret_cast<const uint8_t *>(&command);
+		buf.insert(buf.end(), bytes, bytes + sizeof command);
 	};
+	if (parser.has("--initialise"))
+		append(preamble, InitCommand{});
+	if (parser.has("--status"))
+		append(preamble, StatusRequest{});
+
+	// a single page is copied out to patch its page index and end marker
+	auto job = static_cast<const uint8_t *>(data);
+	size_t jobSize = size;
+	std::vector<uint8_t> pageCopy;
+	if (page) {
+		pageCopy.assign(job + page->offset, job + page->end());
+		if (page->pageIndexOffset)
+			pageCopy[page->pageIndexOffset] = PrintInformationCommand::Last;
+		pageCopy.back() = 0x1a;
+		job = pageCopy.data();
+		jobSize = pageCopy.size();
+	}
 
-	const char m = 'M';
-	uint8_t v = NoCompression;
-};
+	bp::MonitoredSender sender{out, resumeTimeout};
+	auto error = sender.send(preamble.data(), preamble.size());
+	if (error.empty())
+		error = sender.send(job, jobSize);
+	::munmap(data, size);
+
+	const auto &progress = sender.progress();
+	if (!error.empty())
+		return std::format("{}, stopped after {} bytes ({} raster lines)", error, progress.bytes, progress.rasterLines);
+	if (progress.pauses) {
+		std::cerr << std::format("paused {} times for {} ms\n", progress.pauses,
+			std::chrono::duration_cast<std::chrono::milliseconds>(progress.paused).count());
+	}
 
-template <class T>
-void writeStruct(std::ofstream &out, const T &c)
-{
-	// for (size_t i = 0; i < sizeof(c); ++i)
-	// 	std::cerr << std::hex << std::setfill('0') << std::setw(2) << uint32_t(uint8_t(((char *)&c)[i]));
-	// std::cerr << "\n";
-	out.write(reinterpret_cast<const char *>(&c), sizeof(c));
+	return {};
 }
 
-void writeEncodedLine(std::ofstream &out, uint8_t* line, png::uint_32 height)
+// renders every job of a JSON Lines manifest in this one process on all cores, into one multi-page job or (--separate) a
+// file per job
+static int printBatch(const ArgParser &parser)
 {
-	// std::cerr << "print line: ";
-	// for (png::uint_32 i = 0; i < height; ++i)
-		// std::cerr << std::hex << std::setfill('0') << std::setw(2) << static_cast<uint32_t>(static_cast<uint8_t>(line[i]));
-	// std::cerr << "\n";
-
-	static const png::uint_32 AuxSize = 20;
-
-	uint8_t output[height + 3 + AuxSize];
-	size_t size = 3, counter = 1;
-	uint8_t last = -1;
-
-	uint8_t buffer[height];
-	size_t bufferSize = 0;
-
-	for (png::uint_32 y = 0; y < height; ++y) {
-		if (line[y] == last && y != 0) {
-			if (bufferSize > 1) {
-				output[size++] = bufferSize - 2;
-				// std::cerr << "write buffer (" << bufferSize - 1 << "): ";
-				for (size_t i = 0; i < bufferSize - 1; ++i) {
-					output[size++] = buffer[i];
-					// std::cerr << std::hex << std::setfill('0') << std::setw(2) << static_cast<uint32_t>(static_cast<uint8_t>(buffer[i]));
-				}
-				// std::cerr << "\n";
-				buffer[0] = line[y];
-				bufferSize = 1;
-				assert(counter == 1);
-			}
-			++counter;
+	using Clock = std::chrono::steady_clock;
+	auto ms = [](Clock::duration d) { return std::chrono::duration<double, std::milli>(d).count(); };
+	auto start = Clock::now();
 
-		} else {
-			if (counter > 1) {
-				output[size++] = -(counter - 1);
-				output[size++] = buffer[0];
-				// std::cerr << "write repeated (" << std::hex << static_cast<uint32_t>(static_cast<uint8_t>(buffer[0])) << ") x " << std::dec << counter << "\n";
-
-				buffer[0] = line[y];
-				counter = 1;
-				assert(bufferSize == 1);
-				bufferSize = 0;
+	JobSettings defaults;
+	if (auto error = parseJobOptions(parser, defaults); !error.empty()) {
+		std::cerr << error << "\n";
+		return 1;
+	}
+
+	std::vector<ManifestJob> jobs;
+	{
+		const auto &manifestFile = parser.value("--manifest");
+		std::ifstream file;
+		if (manifestFile != "-") {
+			file.open(manifestFile);
+			if (!file) {
+				std::cerr << "Failed to open '" << manifestFile << "': " << std::strerror(errno) << "\n";
+				return 1;
 			}
-			buffer[bufferSize++] = line[y];
-			last = line[y];
 		}
-	}
-	if (bufferSize > 1) {
-		output[size++] = bufferSize - 1;
-		// std::cerr << "write buffer (" << bufferSize << "): ";
-		for (size_t i = 0; i < bufferSize; ++i) {
-			output[size++] = buffer[i];
-			// std::cerr << std::hex << std::setfill('0') << std::setw(2) << static_cast<uint32_t>(static_cast<uint8_t>(buffer[i]));
+		if (auto error = readManifest(manifestFile == "-" ? std::cin : file, defaults, jobs); !error.empty()) {
+			std::cerr << manifestFile << ": " << error << "\n";
+			return 1;
 		}
-		// std::cerr << "\n";
-	} else {
-		output[size++] = -(counter - 1);
-		output[size++] = buffer[0];
-		// std::cerr << "write repeated (" << std::hex << static_cast<uint32_t>(static_cast<uint8_t>(buffer[0])) << ") x " << std::dec << counter << "\n";
+	}
+	if (jobs.empty()) {
+		std::cerr << "No jobs in the manifest\n";
+		return 1;
 	}
 
-	output[0] = 'G';
-	output[1] = size - 3;
-	output[2] = 0;
-	// std::cerr << "buffer:     ";
-	for (size_t i = 0; i < size; ++i) {
-		// std::cerr << std::hex << std::setfill('0') << std::setw(2) << static_cast<uint32_t>(static_cast<uint8_t>(output[i]));
-		out << output[i];
+	// every job goes out as soon as it is rendered, to the shared output or a file of its own
+	bool separate = parser.has("--separate");
+	const auto &outputFile = parser.value("-o");
+	if (separate && outputFile.find("{}") == std::string::npos && std::any_of(jobs.begin(), jobs.end(), [](const auto &job) { return job.output.empty(); })) {
+		std::cerr << "With --separate, -o has to contain {} for the job number, or every job needs an output\n";
+		return 1;
+	}
+	auto open = [](const std::string &path) { return path == "-" ? ::dup(STDOUT_FILENO) : bp::openOutput(path); };
+	int out = -1;
+	if (!separate && (out = open(outputFile)) < 0) {
+		std::cerr << "Failed to open '" << outputFile << "': " << std::strerror(errno) << "\n";
+		return 1;
 	}
-	// std::cerr << "\n\n";
-}
 
-struct Flags {
-	enum Value : uint8_t {
-		Compressed = 0x01,
-		Center = 0x02,
-		Test = 0x80,
+	// consecutive labels that can share a cut are chained, every page learns how long its chain is
+	bool chain = parser.has("--chain");
+	if (chain && separate) {
+		std::cerr << "--chain makes one job of the batch, it can't be used with --separate\n";
+		return 1;
+	}
+	std::vector<bp::ChainGroup> chains;
+	std::vector<unsigned> chainLabels(jobs.size(), 1);
+	if (chain) {
+		std::vector<JobSettings> settings;
+		for (const auto &job : jobs)
+			settings.push_back(job.settings);
+		chains = bp::planChains(settings);
+		for (const auto &group : chains)
+			std::fill_n(chainLabels.begin() + group.first, group.jobs, group.labels);
+	}
+
+	size_t pageCount = 0, pageNr = 0;
+	for (const auto &job : jobs)
+		pageCount += job.settings.copies;
+	uint64_t totalBytes = 0;
+	Clock::duration loading{}, rendering{}, writing{};
+
+	// jobs are loaded and rasterized on all the workers, this thread writes them out in manifest order
+	struct RenderedRequest {
+		std::string data;
+		bp::SpoolIndex index;
+		Clock::duration loading{}, rendering{};  // the cache lookup counts as loading
+		std::string error;
+		bool cached = false;
 	};
-};
-
-static unsigned TestImageWidth = 16 * 8;
-
-struct Exec {
-	std::string error;
-
-	inline operator bool() const { return error.empty(); }
-};
-
-namespace {
-	// uint16_t randomMask(uint8_t bitsOn)
-	// {
-	// 	static auto rng = std::default_random_engine{};
-	//
-	// 	unsigned mask[16];
-	// 	for (unsigned i = 0; i < 16; ++i)
-	// 		mask[i] = i;
-	// 	std::ranges::shuffle(mask, rng);
-	//
-	// 	uint16_t p = 0;
-	// 	for (uint8_t i = 0; i < bitsOn; ++i)
-	// 		p |= 1 << mask[i];
-	// 	return p;
-	// };
-	//
-	// uint16_t patternMask(uint8_t bitsOn)
-	// {
-	// 	static const unsigned Mask[16] = {6, 9, 0, 15, 12, 3, 5, 10, 4, 11, 2, 13, 7, 8, 1, 14};
-	//
-	// 	uint16_t p = 0;
-	// 	for (uint8_t i = 0; i < bitsOn; ++i)
-	// 		p |= 1 << Mask[i];
-	// 	return p;
-	// };
-
-	uint16_t alternatingPatternMask(uint8_t bitsOn)
-	{
-		static const unsigned Mask[16] = {6, 9, 0, 15, 12, 3, 5, 10, 4, 11, 2, 13, 7, 8, 1, 14};
-		static bool transpose = false;
-
-		uint16_t p = 0;
-		for (uint8_t i = 0; i < 4; ++i) {
-			for (uint8_t j = 0; j < 4; ++j) {
-				if (transpose) {
-					if (i * 4 + j < bitsOn)
-						p |= 1 << Mask[4 * i + j];
-				} else {
-					if (j * 4 + i < bitsOn)
-						p |= 1 << Mask[4 * j + i];
-				}
+	std::unique_ptr<bp::RenderCache> cache;
+	if (parser.has("--render-cache")) {
+		uint64_t maxBytes = parser.has("--render-cache-size") ? std::stoull(parser.value("--render-cache-size")) << 20 : bp::RenderCache::DefaultMaxBytes;
+		cache = std::make_unique<bp::RenderCache>(parser.value("--render-cache"), maxBytes);
+	}
+	auto render = [&jobs, &cache](size_t i) {
+		RenderedRequest request;
+		const auto &settings = jobs[i].settings;
+		auto start = Clock::now();
+
+		std::string imageData;
+		std::string key = cache ? cache->key(settings, imageData) : std::string{};
+		if (!key.empty() && cache->get(key, request.data)) {
+			request.index = bp::SpoolIndex{};
+			if (bp::scanSpool(reinterpret_cast<const uint8_t *>(request.data.data()), request.data.size(), 0, request.index).empty()) {
+				request.cached = true;
+				request.loading = Clock::now() - start;
+				return request;
 			}
+			request.index = bp::SpoolIndex{};
 		}
 
-		transpose = !transpose;
-
-		return p;
+		uint8_t flags;
+		png::image<png::rgb_pixel> image;
+		unsigned imageWidth;
+		std::istringstream imageIn{std::move(imageData)};
+		if (auto exec = loadImage(settings, image, imageWidth, flags, bp::RenderCache::imageStream(settings, key, imageIn)); !exec) {
+			request.error = exec.error;
+			return request;
+		}
+		auto loaded = Clock::now();
+		std::ostringstream out;
+		if (auto exec = writePrintRequest(out, settings, image, imageWidth, flags, &request.index); !exec) {
+			request.error = exec.error;
+			return request;
+		}
+		request.data = std::move(out).str();
+		request.loading = loaded - start;
+		request.rendering = Clock::now() - loaded;
+		if (!key.empty()) {
+			if (auto error = cache->put(key, request.data); !error.empty())
+				std::cerr << "Render cache: " << error << "\n";
+		}
+		return request;
 	};
-}
-
-struct Margins {
-	unsigned leftMargin;
-	unsigned rightMargin;
-	unsigned height;  // pixels
-
-	static const unsigned Pins = 560;
-
-	Margins(std::string_view mediaWidth)
-	{
-		const auto margin = bp::margins().at(mediaWidth);
-		// left and right margins are swapped as the data is mirrored
-		leftMargin = margin.second;
-		rightMargin = margin.first;
-		rightMargin += 4 - (leftMargin + rightMargin) % 4;  // adjust to full bytes
-		height = (Pins - leftMargin - rightMargin) / 4;
-	}
-};
-
-Exec writePng(std::ofstream &out, const png::image<png::rgb_pixel> &img, std::string_view mediaWidth, unsigned imageWidth, uint8_t flags)
-{
-	static const unsigned Height = 70;
-
-	if (!bp::margins().contains(mediaWidth))
-		return Exec{std::format("writePng: unrecognised media width {}", mediaWidth)};
-
-	Margins margins{mediaWidth};
-	unsigned leftMargin = margins.leftMargin;
-	unsigned rightMargin = margins.rightMargin;
-
-	png::uint_32 width = imageWidth;
-	png::uint_32 height = margins.height;
-	if (!(flags & Flags::Test))
-		height = img.get_height();
-
-	if (Margins::Pins < leftMargin + height * 4 + rightMargin)
-		return Exec{std::format("Height of the image too large: left margin = {} pins, right margin = {} pins, expected = {} pixels ({} pins), received {} pixels ({} pins)", rightMargin, leftMargin, (Margins::Pins - leftMargin - rightMargin) / 4, Margins::Pins - leftMargin - rightMargin, height, height * 4)};
-
-	if (flags & Flags::Center) {
-		leftMargin += (margins.height - height) * 4 / 2;
-		rightMargin += Margins::Pins - height * 4 - leftMargin - rightMargin;
-	}
-
-	if (Margins::Pins != leftMargin + height * 4 + rightMargin)
-		return Exec{std::format("Height of the image doesn't match the tape: left margin = {} pins, right margin = {} pins, expected at most = {} pixels ({} pins), received {} pixels ({} pins)", rightMargin, leftMargin, (Margins::Pins - leftMargin - rightMargin) / 4, Margins::Pins - leftMargin - rightMargin, height, height * 4)};
-
-	uint8_t vline[4][Height];
-	bool zeroLine[4];
-
-	auto intensity = [](const png::basic_rgb_pixel<unsigned char> &p) { return 15 - (p.red + p.green + p.blue) / 3 / 16; };
-	auto maskFn = ::alternatingPatternMask;
-
-	for (png::uint_32 x = 0; x < width; ++x) {
-		std::memset(vline, 0, sizeof vline);
-		*(reinterpret_cast<uint32_t *>(zeroLine)) = 0;
-
-		for (png::uint_32 y = 0; y < height; ++y) {
-			uint16_t pixel;
-			if (flags & Flags::Test)
-				pixel = maskFn(x / 8 + 1);
-			else
-				pixel = maskFn(intensity(img.get_pixel(x, y)));
-
-			for (unsigned i = 0; i < 4; ++i) {
-				for (unsigned j = 0; j < 4; ++j) {
-					if (pixel & (1 << (4 * i + j))) {
-						unsigned pin = leftMargin + y * 4 + j;
-						unsigned byteNr = pin / 8;
-						unsigned bitInPixel = 7 - pin % 8;
-						vline[i][byteNr] |= 1 << bitInPixel;
-						zeroLine[i] = false;
-					}
+	size_t workers = parser.has("--workers") ? std::stoul(parser.value("--workers")) : std::max(std::thread::hardware_concurrency(), 1u);
+	size_t window = parser.has("--queue") ? std::stoul(parser.value("--queue")) : 2 * workers;
+	bp::OrderedWorkerPool<RenderedRequest> pool{jobs.size(), render, workers, window};
+
+	for (size_t i = 0; auto request = pool.next(); ++i) {
+		const auto &settings = jobs[i].settings;
+		if (!request->error.empty()) {
+			std::cerr << "job " << i << ": " << request->error << "\n";
+			return 1;
+		}
+		auto &buffer = request->data;
+		auto writeStart = Clock::now();
+
+		// pages of all the jobs become one job, as make_request merge would make it
+		if (!separate) {
+			for (const auto &page : request->index.pages) {
+				uint8_t pageIndex = pageNr + 1 == pageCount ? PrintInformationCommand::Last : pageNr == 0 ? PrintInformationCommand::Starting : PrintInformationCommand::Other;
+				buffer[page.offset + page.pageIndexOffset] = pageIndex;
+				buffer[page.end() - 1] = pageNr + 1 == pageCount ? 0x1a : 0x0c;
+				++pageNr;
+				if (chainLabels[i] < 2)
+					continue;
+				if (auto error = bp::chainPage(reinterpret_cast<uint8_t *>(buffer.data()) + page.offset, page.size, chainLabels[i]); !error.empty()) {
+					std::cerr << "job " << i << ": " << error << "\n";
+					return 1;
 				}
 			}
 		}
 
-		for (unsigned i = 0; i < 4; ++i) {
-			if (zeroLine[i]) {
-				out << 'Z';
-			} else if (flags & Flags::Compressed) {
-				writeEncodedLine(out, vline[i], Height);
-			} else {
-				out << 'G' << static_cast<uint8_t>(70) << static_cast<uint8_t>(0);
-				for (png::uint_32 y = 0; y < Height; ++y)
-					out << vline[i][y];
-			}
+		std::string path = outputFile;
+		if (separate) {
+			path = jobs[i].output.empty() ? outputFile.substr(0, outputFile.find("{}")) + std::to_string(i) + outputFile.substr(outputFile.find("{}") + 2) : jobs[i].output;
+			out = open(path);
 		}
-	}
-
-	return Exec{};
-}
-
-Exec writePrintRequest(std::ofstream &out, const ArgParser &parser, const png::image<png::rgb_pixel> &image, unsigned imageWidth, uint8_t flags)
-{
-	auto tapeWidth = parser.value("--tape-width");
-	if (!bp::tapeWidth().contains(tapeWidth))
-		return Exec(std::format("writePrintRequest: unrecognised tape width ", tapeWidth));
-
-	unsigned copies = std::stoi(parser.value("--copies"));
-	for (unsigned copyIndex = 0; copyIndex < copies; ++copyIndex) {
-		writeStruct(out, SwitchDynamicCommandMode{});
-
-		PrintInformationCommand printInformationCommand;
-		printInformationCommand.mediaWidth = bp::tapeWidth().at(tapeWidth);
-		printInformationCommand.setRasterNumber(4 * imageWidth);
-		if (copyIndex + 1 == copies)
-			printInformationCommand.pageIndex = PrintInformationCommand::Last;
-		else if (copyIndex == 0)
-			printInformationCommand.pageIndex = PrintInformationCommand::Starting;
-		else
-			printInformationCommand.pageIndex = PrintInformationCommand::Other;
-		writeStruct(out, printInformationCommand);
-
-		VariousModeSettings variousModeSettings;
-		if (!parser.has("--no-auto-cut"))
-			variousModeSettings.v |= VariousModeSettings::AutoCut;
-		if (parser.has("--mirror-printing"))
-			variousModeSettings.v |= VariousModeSettings::MirrorPrinting;
-		writeStruct(out, variousModeSettings);
-
-		writeStruct(out, PageNumberInCutEachLabels{});
-
-		AdvancedModeSettings advancedModeSettings;
-		if (parser.has("--no-half-cut"))
-			advancedModeSettings.halfCut = false;
-		if (parser.has("--chain-printing"))
-			advancedModeSettings.noChainPrinting = false;
-		writeStruct(out, advancedModeSettings);
-
-		SpecifyMarginAmount specifyMarginAmount;
-		specifyMarginAmount.v[0] = std::stoi(parser.value("--set-length-margin"));
-		writeStruct(out, specifyMarginAmount);
-
-		SelectCompressionMode compressionMode;
-		if (flags & Flags::Compressed)
-			compressionMode.v = SelectCompressionMode::Tiff;
-		else
-			compressionMode.v = SelectCompressionMode::NoCompression;
-		writeStruct(out, compressionMode);
-
-		auto exec = writePng(out, image, parser.value("--tape-width"), imageWidth, flags);
-		if (!exec)
-			return exec;
-
-		if (copyIndex + 1 < copies)
-			out << static_cast<uint8_t>(0x0c);  // page end marker
-		else
-			out << static_cast<uint8_t>(0x1a);  // final page marker
-	}
-
-	return Exec{};
-}
+		if (out < 0 || !bp::writeAll(out, buffer.data(), buffer.size())) {
+			std::cerr << "Failed to write to '" << path << "': " << std::strerror(errno) << "\n";
+			return 1;
+		}
+		if (separate)
+			::close(out);
+		auto written = Clock::now();
 
-png::image<png::rgb_pixel> enlargeImage(const png::image<png::rgb_pixel> &image)
-{
-	auto width = image.get_width();
-	auto height = image.get_height();
-	png::image<png::rgb_pixel> img{width * 2, height * 2};
-	for (png::uint_32 x = 0; x < width; ++x) {
-		for (png::uint_32 y = 0; y < height; ++y) {
-			const auto &pixel = image.get_pixel(y, x);
-			img.set_pixel(y * 2, x * 2, pixel);
-			img.set_pixel(y * 2 + 1, x * 2, pixel);
-			img.set_pixel(y * 2, x * 2 + 1, pixel);
-			img.set_pixel(y * 2 + 1, x * 2 + 1, pixel);
+		if (request->cached) {
+			std::cerr << std::format("job {} ({}): cached, read in {:.1f} ms, written in {:.1f} ms, {} pages, {} bytes\n",
+				i, settings.image, ms(request->loading), ms(written - writeStart), request->index.pages.size(), buffer.size());
+		} else {
+			std::cerr << std::format("job {} ({}): loaded in {:.1f} ms, rendered in {:.1f} ms, written in {:.1f} ms, {} pages, {} bytes\n",
+				i, settings.image, ms(request->loading), ms(request->rendering), ms(written - writeStart), request->index.pages.size(), buffer.size());
 		}
+		loading += request->loading;
+		rendering += request->rendering;
+		writing += written - writeStart;
+		totalBytes += buffer.size();
+	}
+	if (!separate)
+		::close(out);
+
+	auto counters = pool.counters();
+	size_t stolen = 0;
+	for (const auto &worker : counters.workers)
+		stolen += worker.stolen;
+	std::cerr << std::format("{} workers {:.0f}% busy, {} jobs stolen, at most {} of {} rendered jobs queued, writer waited {:.1f} ms\n",
+		counters.workers.size(), 100 * counters.utilisation(), stolen, counters.maxQueueDepth, window, ms(counters.consumerWait));
+	if (cache) {
+		auto cacheCounters = cache->counters();
+		std::cerr << std::format("render cache: {} hits, {} misses, {} evicted\n", cacheCounters.hits, cacheCounters.misses, cacheCounters.evictions);
 	}
+	if (chain) {
+		auto savings = bp::chainSavings(chains);
+		std::cerr << std::format("{} labels in {} chains, about {:.0f} mm of tape and {:.1f} s saved against printing them one by one\n",
+			pageCount, chains.size(), savings.tapeMm, savings.seconds);
+	}
+	std::cerr << std::format("{} jobs, {} pages, {} bytes in {:.1f} ms: loading {:.1f} ms, rendering {:.1f} ms, writing {:.1f} ms\n",
+		jobs.size(), pageCount, totalBytes, ms(Clock::now() - start), ms(loading), ms(rendering), ms(writing));
 
-	return img;
+	return 0;
 }
 
 int main(int argc, char **argv)
@@ -424,6 +288,10 @@ int main(int argc, char **argv)
 		Print,
 		Status,
 		Initialise,
+		Send,
+		Index,
+		Merge,
+		Batch,
 	} command;
 
 	if (strcmp(argv[1], "print") == 0)
@@ -432,6 +300,14 @@ int main(int argc, char **argv)
 		command = Command::Status;
 	else if (strcmp(argv[1], "initialise") == 0)
 		command = Command::Initialise;
+	else if (strcmp(argv[1], "send") == 0)
+		command = Command::Send;
+	else if (strcmp(argv[1], "index") == 0)
+		command = Command::Index;
+	else if (strcmp(argv[1], "merge") == 0)
+		command = Command::Merge;
+	else if (strcmp(argv[1], "batch") == 0)
+		command = Command::Batch;
 	else
 		assert(false);
 
@@ -452,6 +328,12 @@ int main(int argc, char **argv)
 			parser.addArgument(Arg{"--scale-down"}.setOptional().setCount(0));
 			parser.addArgument(Arg{"--scale-up"}.setOptional().setCount(0));
 			parser.addArgument(Arg{"--center"}.setOptional().setCount(0));
+			parser.addArgument(Arg{"--index"}.setOptional());
+			parser.addArgument(Arg{"--shm"}.setOptional());
+			parser.addArgument(Arg{"--monitor"}.setOptional().setCount(0));
+			parser.addArgument(Arg{"--resume-timeout"}.setOptional());
+			parser.addArgument(Arg{"--render-cache"}.setOptional());
+			parser.addArgument(Arg{"--render-cache-size"}.setOptional());
 			break;
 		case Command::Status:
 			parser.addArgument(Arg{"-o"});
@@ -459,6 +341,37 @@ int main(int argc, char **argv)
 		case Command::Initialise:
 			parser.addArgument(Arg{"-o"});
 			break;
+		case Command::Send:
+			parser.addArgument(Arg{"-i"});
+			parser.addArgument(Arg{"-o"});
+			parser.addArgument(Arg{"--initialise"}.setOptional().setCount(0));
+			parser.addArgument(Arg{"--status"}.setOptional().setCount(0));
+			parser.addArgument(Arg{"--page"}.setOptional());
+			parser.addArgument(Arg{"--index"}.setOptional());
+			parser.addArgument(Arg{"--shm"}.setOptional());
+			parser.addArgument(Arg{"--monitor"}.setOptional().setCount(0));
+			parser.addArgument(Arg{"--resume-timeout"}.setOptional());
+			break;
+		case Command::Index:
+			parser.addArgument(Arg{"-i"});
+			parser.addArgument(Arg{"-o"}.setOptional());
+			break;
+		case Command::Merge:
+			parser.addArgument(Arg{"-i"}.setRepeatable());
+			parser.addArgument(Arg{"-o"});
+			parser.addArgument(Arg{"--index"}.setOptional());
+			break;
+		case Command::Batch:
+			parser.addArgument(Arg{"--manifest"});
+			parser.addArgument(Arg{"-o"});
+			parser.addArgument(Arg{"--separate"}.setOptional().setCount(0));
+			parser.addArgument(Arg{"--chain"}.setOptional().setCount(0));
+			parser.addArgument(Arg{"--workers"}.setOptional());
+			parser.addArgument(Arg{"--queue"}.setOptional());
+			parser.addArgument(Arg{"--render-cache"}.setOptional());
+			parser.addArgument(Arg{"--render-cache-size"}.setOptional());
+			addJobOptions(parser, false);
+			break;
 	}
 
 	parser.parse(argc - 2, argv + 2);
@@ -467,60 +380,124 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	if (command == Command::Batch)
+		return printBatch(parser);
+
 	if (command == Command::Print) {
-		uint8_t flags = 0;
+		JobSettings settings;
+		settings.image = parser.value("-i");
+		if (auto error = parseJobOptions(parser, settings); !error.empty()) {
+			std::cerr << error << "\n";
+			return 1;
+		}
 
+		// a request rendered before for the same image and settings goes out as it is
+		std::unique_ptr<bp::RenderCache> cache;
+		std::string cacheKey, cached, imageData;
+		if (parser.has("--render-cache")) {
+			uint64_t maxBytes = parser.has("--render-cache-size") ? std::stoull(parser.value("--render-cache-size")) << 20 : bp::RenderCache::DefaultMaxBytes;
+			cache = std::make_unique<bp::RenderCache>(parser.value("--render-cache"), maxBytes);
+			cacheKey = cache->key(settings, imageData);
+		}
+		bool hit = !cacheKey.empty() && cache->get(cacheKey, cached);
+
+		uint8_t flags = 0;
 		png::image<png::rgb_pixel> image;
 		unsigned imageWidth;
-		if (parser.value("-i") == "test") {
-			flags |= Flags::Test;
-			imageWidth = TestImageWidth;
-		} else {
-			image.read(parser.value("-i"));
-			imageWidth = image.get_width();
-
-			unsigned imageHeight = image.get_height();
-			if (parser.has("--scale-up")) {
-				auto expectedHeight = Margins{parser.value("--tape-width")}.height;
-				while (imageHeight * 2 <= expectedHeight) {
-					std::cerr << std::format("height: {}, expected height: {}, enlarging image\n", imageHeight, expectedHeight);
-					image = enlargeImage(image);
-					imageHeight = image.get_height();
-					imageWidth = image.get_width();
-				}
+		if (!hit) {
+			std::istringstream imageIn{std::move(imageData)};
+			if (auto exec = loadImage(settings, image, imageWidth, flags, bp::RenderCache::imageStream(settings, cacheKey, imageIn)); !exec) {
+				std::cerr << exec.error << "\n";
+				return 1;
 			}
-			if (parser.has("--scale-down")) {
-				auto expectedHeight = Margins{parser.value("--tape-width")}.height;
-				auto expectedWidth = static_cast<unsigned>(static_cast<double>(expectedHeight) / static_cast<double>(imageHeight) * static_cast<double>(imageWidth));
-				static const unsigned FilterSize = 3;
-				if (imageHeight > expectedHeight) {
-					image = scaleLanczos(image, expectedHeight, expectedWidth, FilterSize);
-					imageHeight = image.get_height();
-					imageWidth = image.get_width();
-				}
+		}
+
+		// "-" is stdout, anything that isn't a regular file (device, pipe, socket) is streamed to as well
+		const auto &outputFile = parser.value("-o");
+		int fd = outputFile == "-" ? ::dup(STDOUT_FILENO) : bp::openOutput(outputFile);
+		if (fd < 0) {
+			std::cerr << "Failed to open '" << outputFile << "': " << std::strerror(errno) << "\n";
+			return 1;
+		}
+		struct stat st;
+		if (::fstat(fd, &st) == 0 && !S_ISREG(st.st_mode))
+			flags |= Flags::Stream;
+
+		// the sidecar index is brought up to date with whatever the spool held before this request
+		bp::SpoolIndex index;
+		std::string indexFile;
+		if (parser.has("--index")) {
+			if (flags & Flags::Stream) {
+				std::cerr << "Cannot index '" << outputFile << "', not a regular file\n";
+				return 1;
+			}
+			indexFile = parser.value("--index");
+			if (auto error = bp::readSpoolIndex(indexFile, index); !error.empty())
+				std::cerr << "Ignoring spool index: " << error << "\n";
+			if (auto error = bp::updateSpoolIndex(outputFile, index); !error.empty()) {
+				std::cerr << "Failed to index '" << outputFile << "': " << error << "\n";
+				return 1;
 			}
-			std::string previewPath{"/tmp/preview.png"};
+		}
+
+		std::string previewPath{"/tmp/preview.png"};
+		if (!hit && !(flags & (Flags::Test | Flags::Stream))) {
 			std::cerr << "preview: " << previewPath << "\n";
 			image.write(previewPath);
 		}
 
+		{
+			// streamed requests are rasterized and written by separate threads
+			std::unique_ptr<bp::OutputBuf> buf;
+			if (flags & Flags::Stream)
+				buf = std::make_unique<bp::PipelineBuf>(fd);
+			else
+				buf = std::make_unique<bp::FdBuf>(fd);
+			std::ostream out{buf.get()};
+
+			Exec exec;
+			if (hit) {
+				out.write(cached.data(), cached.size());
+				if (!indexFile.empty())
+					exec.error = bp::scanSpool(reinterpret_cast<const uint8_t *>(cached.data()), cached.size(), index.spoolSize, index);
+			} else if (cache) {
+				// rendered into memory, so that the complete request can be stored
+				std::ostringstream request;
+				exec = writePrintRequest(request, settings, image, imageWidth, flags, indexFile.empty() ? nullptr : &index);
+				auto data = std::move(request).str();
+				out.write(data.data(), data.size());
+				if (exec && !cacheKey.empty()) {
+					if (auto error = cache->put(cacheKey, data); !error.empty())
+						std::cerr << "Render cache: " << error << "\n";
+				}
+			} else {
+				exec = writePrintRequest(out, settings, image, imageWidth, flags, indexFile.empty() ? nullptr : &index);
+			}
+			if (!exec) {
+				std::cerr << exec.error << "\n";
+				return 1;
+			}
 
-		if (parser.value("--compression") == "tiff") {
-			flags |= Flags::Compressed;
-		} else if (parser.value("--compression") != "no compression") {
-			std::cerr << "Invalid compression mode: " << parser.value("--compression") << "\n";
-			return 1;
+			out.flush();
+			if (!out || !buf->finish()) {
+				std::cerr << "Failed to write to '" << outputFile << "': " << std::strerror(errno) << "\n";
+				return 1;
+			}
 		}
+		if (parser.has("--shm"))
+			markJobWritten(parser.value("--shm"));
 
-		if (parser.has("--center"))
-			flags |= Flags::Center;
-
-		std::ofstream out(parser.value("-o"), std::ofstream::binary | std::ios_base::app);
+		if (!indexFile.empty()) {
+			if (auto error = bp::writeSpoolIndex(indexFile, outputFile, index); !error.empty()) {
+				std::cerr << error << "\n";
+				return 1;
+			}
+		}
 
-		auto exec = writePrintRequest(out, parser, image, imageWidth, flags);
-		if (!exec) {
-			std::cerr << exec.error << "\n";
-			return 1;
+		// the preview doesn't delay the first byte of a streamed request
+		if (!hit && (flags & Flags::Stream) && !(flags & Flags::Test)) {
+			std::cerr << "preview: " << previewPath << "\n";
+			image.write(previewPath);
 		}
 
 	} else if (command == Command::Status) {
@@ -530,6 +507,121 @@ int main(int argc, char **argv)
 	} else if (command == Command::Initialise) {
 		std::ofstream out(parser.value("-o"), std::ofstream::binary | std::ios_base::app);
 		writeStruct(out, InitCommand{});
+
+	} else if (command == Command::Send) {
+		const auto &inputFile = parser.value("-i");
+		int in = ::open(inputFile.c_str(), O_RDONLY | O_CLOEXEC);
+		if (in < 0) {
+			std::cerr << "Failed to open '" << inputFile << "': " << std::strerror(errno) << "\n";
+			return 1;
+		}
+		off_t size = bp::fileSize(in);
+
+		const auto &outputFile = parser.value("-o");
+		int out = parser.has("--monitor") ? bp::openOutput(outputFile, O_RDWR) : bp::openOutput(outputFile);
+		if (out < 0) {
+			std::cerr << "Failed to open '" << outputFile << "': " << std::strerror(errno) << "\n";
+			return 1;
+		}
+
+		// a single page is looked up in the sidecar index and sent as a job of its own
+		bp::SpoolPage page;
+		if (parser.has("--page")) {
+			bp::SpoolIndex index;
+			auto indexFile = parser.has("--index") ? parser.value("--index") : bp::indexPath(inputFile);
+			if (auto error = bp::readSpoolIndex(indexFile, index); !error.empty())
+				std::cerr << "Ignoring spool index: " << error << "\n";
+			if (auto error = bp::updateSpoolIndex(inputFile, index); !error.empty()) {
+				std::cerr << "Failed to index '" << inputFile << "': " << error << "\n";
+				return 1;
+			}
+			unsigned pageNr = std::stoi(parser.value("--page"));
+			if (pageNr >= index.pages.size()) {
+				std::cerr << "Page " << pageNr << " out of range, '" << inputFile << "' has " << index.pages.size() << " pages\n";
+				return 1;
+			}
+			page = index.pages[pageNr];
+		}
+
+		if (parser.has("--monitor")) {
+			// written in whole commands, pausing while the printer can't take more
+			std::chrono::milliseconds resumeTimeout{parser.has("--resume-timeout") ? std::stoi(parser.value("--resume-timeout")) : 30000};
+			if (auto error = sendMonitored(out, in, size, parser.has("--page") ? &page : nullptr, parser, resumeTimeout); !error.empty()) {
+				std::cerr << "Failed to send '" << inputFile << "' to '" << outputFile << "': " << error << "\n";
+				return 1;
+			}
+		} else {
+			// same preamble as the one manage.py writes before a print request
+			bool ok = true;
+			if (parser.has("--initialise"))
+				ok = ok && bp::writeStruct(out, InitCommand{});
+			if (parser.has("--status"))
+				ok = ok && bp::writeStruct(out, StatusRequest{});
+			if (parser.has("--page"))
+				ok = ok && bp::sendPage(out, in, page, PrintInformationCommand::Last, 0x1a);
+			else
+				ok = ok && size >= 0 && bp::sendFile(out, in, 0, size);
+			if (!ok) {
+				std::cerr << "Failed to send '" << inputFile << "' to '" << outputFile << "': " << std::strerror(errno) << "\n";
+				return 1;
+			}
+		}
+		if (parser.has("--shm"))
+			markJobWritten(parser.value("--shm"));
+
+		::close(in);
+		::close(out);
+
+	} else if (command == Command::Index) {
+		const auto &inputFile = parser.value("-i");
+		auto indexFile = parser.has("-o") ? parser.value("-o") : bp::indexPath(inputFile);
+
+		bp::SpoolIndex index;
+		if (auto error = bp::readSpoolIndex(indexFile, index); !error.empty())
+			std::cerr << "Ignoring spool index: " << error << "\n";
+		if (auto error = bp::updateSpoolIndex(inputFile, index); !error.empty()) {
+			std::cerr << "Failed to index '" << inputFile << "': " << error << "\n";
+			return 1;
+		}
+		if (auto error = bp::writeSpoolIndex(indexFile, inputFile, index); !error.empty()) {
+			std::cerr << error << "\n";
+			return 1;
+		}
+		std::cerr << index.pages.size() << " pages indexed in " << indexFile << "\n";
+
+	} else if (command == Command::Merge) {
+		const auto &outputFile = parser.value("-o");
+		int out = bp::openOutput(outputFile);
+		if (out < 0) {
+			std::cerr << "Failed to open '" << outputFile << "': " << std::strerror(errno) << "\n";
+			return 1;
+		}
+
+		bp::SpoolIndex index;
+		std::string indexFile;
+		if (parser.has("--index")) {
+			indexFile = parser.value("--index");
+			if (auto error = bp::readSpoolIndex(indexFile, index); !error.empty())
+				std::cerr << "Ignoring spool index: " << error << "\n";
+			if (auto error = bp::updateSpoolIndex(outputFile, index); !error.empty()) {
+				std::cerr << "Failed to index '" << outputFile << "': " << error << "\n";
+				return 1;
+			}
+		}
+
+		auto error = bp::mergeSpools(out, parser.values("-i"), indexFile.empty() ? nullptr : &index);
+		::close(out);
+		if (!error.empty()) {
+			std::cerr << error << "\n";
+			return 1;
+		}
+
+		if (!indexFile.empty()) {
+			if (auto error = bp::writeSpoolIndex(indexFile, outputFile, index); !error.empty()) {
+				std::cerr << error << "\n";
+				return 1;
+			}
+		}
 	}
 
 	return 0;
@@ -1,53 +1,76 @@
 #!/usr/bin/python3
 
 import argparse
+import json
 import os
 import subprocess
-from time import sleep
 
 
-def request_status(args):
-	request_status_cmd = ["./make_request", "status", "-o", args.device_path]
+def drain_device(args):
+	drain_cmd = ["./read_status", args.device_path, "--drain"]
 	if args.verbose:
-		print(" ".join(request_status_cmd))
-	subprocess.check_output(request_status_cmd)
-
-
-def read_status(args):
-	read_status_cmd = ["./read_status", args.device_path]
-	error = None
-	output = None
+		print(" ".join(drain_cmd))
 	try:
-		if args.verbose:
-			print(" ".join(read_status_cmd))
-		output = subprocess.check_output(read_status_cmd, stderr=subprocess.STDOUT).decode("utf-8").strip().split("\n")
+		output = subprocess.check_output(drain_cmd, stderr=subprocess.STDOUT).decode("utf-8").strip()
 	except subprocess.CalledProcessError as e:
-		error = e.output.decode().strip()
-		return None, error
-
-	return {
-		e[0].strip(): ":".join(e[1:]).strip()
-		for line in output if (e := line.split(":"))
-	}, None
+		raise Exception(f"Failed to drain '{args.device_path}': '{e.output.decode().strip()}'")
+	if args.verbose:
+		print(output)
 
 
-def get_status(args, attempts=5, wait=1):
+def get_status(args, attempts=5, timeout=500):
+	# one process sends the request and waits for the reply to arrive, no fixed sleep
+	if args.shm:
+		# a running status_daemon owns the device, read its latest status instead of asking the printer
+		get_status_cmd = ["./read_status", args.shm, "--shm", "--max-age", str(args.shm_max_age), "--format", "json"]
+	else:
+		get_status_cmd = ["./status_daemon", "-d", args.device_path, "--once", "--timeout", str(timeout), "--format", "json"]
 	for i in range(0, attempts):
-		request_status(args)
-		sleep(wait)
-		output, error = read_status(args)
-		if error and args.verbose:
-			print("failed")
-		if not error:
-			return output
+		if args.verbose:
+			print(" ".join(get_status_cmd))
+		try:
+			# the monitor prints every frame it reads, stale unsolicited ones included, the reply comes last
+			lines = subprocess.check_output(get_status_cmd, stderr=subprocess.PIPE).decode("utf-8").splitlines()
+			return json.loads(lines[-1] if lines else "")
+		except subprocess.CalledProcessError as e:
+			error = e.stderr.decode().strip()
+			if args.verbose:
+				print("failed")
+		except ValueError as e:
+			error = f"unexpected status output: {e}"
+			if args.verbose:
+				print("failed")
 	else:
 		raise Exception(f"Failed to read printer status: '{error}'")
 
 
+def find_device(args):
+	# every printer on the host is probed at once, the answers are cached for a minute
+	discover_cmd = ["./ptouch", "discover", "--format", "json"]
+	if args.verbose:
+		print(" ".join(discover_cmd))
+	output = subprocess.run(discover_cmd, stdout=subprocess.PIPE, stderr=subprocess.PIPE).stdout.decode("utf-8")
+	printers = [json.loads(line) for line in output.splitlines()]
+	for printer in printers:
+		if not printer["online"]:
+			continue
+		if args.group == "print" and (
+			args.tape_width not in printer["media width"].split(" / ")
+			or args.tape_type != printer["media type"]
+			or args.tape_colour != printer["tape colour"]
+			or args.text_colour != printer["text colour"]
+		):
+			continue
+		if args.verbose:
+			print(f"Using {printer['path']}")
+		return printer["path"]
+	raise Exception("No matching printer found")
+
+
 def verify_args(args, status):
 	if args.image != "test" and not os.path.exists(args.image):
 		raise Exception(f"Path {args.image} does not exist")
-	if status["error information"]:
+	if status["errors"]:
 		raise Exception(f"Error: {status['error information']}")
 	if status["phase"] != "editing state":
 		raise Exception("Printer must be in 'editing state' phase")
@@ -94,6 +117,8 @@ def make_request(args):
 		command.append("--scale-up")
 	if args.img_center:
 		command.append("--center")
+	if args.shm and args.output_path == args.device_path:
+		command.extend(["--shm", args.shm])
 
 	if args.verbose:
 		print(" ".join(command))
@@ -109,11 +134,15 @@ def parse_args():
 
 	parser_status = subparsers.add_parser("status")
 	parser_status.add_argument("--verbose", "-v", action="store_true")
-	parser_status.add_argument("--device-path", "-d", required=True, default="/dev/usb/lp1", help="file to communicate status request and response with")
+	parser_status.add_argument("--device-path", "-d", required=False, help="file to communicate status request and response with, the first printer found if not given (not used with --shm)")
+	parser_status.add_argument("--shm", required=False, help="shared memory status of a running 'status_daemon --shm', e.g. /ptouch-lp1")
+	parser_status.add_argument("--shm-max-age", required=False, type=int, default=2000, help="milliseconds")
 
 	parser_print = subparsers.add_parser("print")
 	parser_print.add_argument("--verbose", "-v", action="store_true")
-	parser_print.add_argument("--device-path", "-d", required=True, help="file to communicate status request and response with")
+	parser_print.add_argument("--device-path", "-d", required=False, help="file to communicate status request and response with, the first printer with matching media if not given (not looked for with --shm)")
+	parser_print.add_argument("--shm", required=False, help="shared memory status of a running 'status_daemon --shm', e.g. /ptouch-lp1")
+	parser_print.add_argument("--shm-max-age", required=False, type=int, default=2000, help="milliseconds")
 	parser_print.add_argument("--output-path", "-o", required=False, default="/tmp/request.prn", help="file to APPEND print request to, for practical purposes same as device path")
 	parser_print.add_argument("--remove-output", action="store_true", help="removes the output file before creation")
 	parser_print.add_argument("--tape-colour", required=True)
@@ -136,13 +165,13 @@ def parse_args():
 
 def main():
 	args = parse_args()
+	# discovery would talk to the device a status_daemon owns and take its replies, with --shm the device has to be given
+	if not args.device_path and not args.shm:
+		args.device_path = find_device(args)
 
-	# get rid of data in the device
-	error = None
-	while not error:
-		_, error = read_status(args)
-	if not error.startswith("Empty file"):
-		raise Exception(f"Expected '{args.device_path}' to be empty, but got '{error}' when attempting to read")
+	# get rid of data in the device, unless a daemon owns it
+	if not args.shm:
+		drain_device(args)
 
 	status = get_status(args)
 
@@ -4,10 +4,10 @@
 #include <iostream>
 
 #include "ArgParser.hpp"
+#include "commands.hpp"
+#include "spool.hpp"
 
 
-const char ESCAPE = static_cast<char>(27);
-
 struct ParseFlags {
 	enum Value {
 		WithInvalidate = 0x01,
@@ -20,14 +20,6 @@ struct PrintFlags {
 	};
 };
 
-struct SelectCompressionMode {
-	enum Type : uint8_t {
-		NoCompression = 0x00,
-		Reserved = 0x01,  // disabled
-		Tiff = 0x02,
-	};
-};
-
 inline uint32_t ctou(char c)
 {
 	return static_cast<uint32_t>(static_cast<uint8_t>((c)));
@@ -259,6 +251,9 @@ int main(int argc, char **argv)
 	ArgParser parser;
 	parser.addPositionalArgument(Arg{"input"});
 	parser.addArgument(Arg{"--no-data"}.setCount(0).setOptional());
+	parser.addArgument(Arg{"--index"}.setOptional());
+	parser.addArgument(Arg{"--page"}.setOptional());
+	parser.addArgument(Arg{"--pages"}.setCount(0).setOptional());
 
 	parser.parse(argc - 1, argv + 1);
 	if (!parser.isValid()) {
@@ -266,6 +261,57 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	uint8_t printFlags = 0;
+	if (parser.has("--no-data"))
+		printFlags |= PrintFlags::WithoutData;
+
+	if (parser.has("--page") || parser.has("--pages")) {
+		const auto &inputFile = parser.value("input");
+		auto indexFile = parser.has("--index") ? parser.value("--index") : bp::indexPath(inputFile);
+
+		bp::SpoolIndex index;
+		if (auto error = bp::readSpoolIndex(indexFile, index); !error.empty())
+			std::cerr << "Ignoring spool index: " << error << "\n";
+		if (auto error = bp::updateSpoolIndex(inputFile, index); !error.empty()) {
+			std::cerr << "Failed to index '" << inputFile << "': " << error << "\n";
+			return 1;
+		}
+
+		if (parser.has("--pages")) {
+			for (size_t nr = 0; nr < index.pages.size(); ++nr) {
+				const auto &page = index.pages[nr];
+				std::cerr << std::dec
+					<< "page " << nr << ": offset " << page.offset << ", " << page.size << " bytes, "
+					<< page.rasterCount << " raster lines, compression " << static_cast<uint32_t>(page.compression)
+					<< ", media type 0x" << std::hex << static_cast<uint32_t>(page.mediaType)
+					<< ", media width 0x" << static_cast<uint32_t>(page.mediaWidth)
+					<< ", page index " << static_cast<uint32_t>(page.pageIndex) << "\n";
+			}
+		}
+
+		if (parser.has("--page")) {
+			unsigned pageNr = std::stoi(parser.value("--page"));
+			if (pageNr >= index.pages.size()) {
+				std::cerr << "Page " << pageNr << " out of range, '" << inputFile << "' has " << index.pages.size() << " pages\n";
+				return 1;
+			}
+
+			const auto &page = index.pages[pageNr];
+			std::vector<char> pageBuf(page.size);
+			std::ifstream in{inputFile, std::ifstream::binary};
+			in.seekg(page.offset);
+			in.read(pageBuf.data(), pageBuf.size());
+			if (!in) {
+				std::cerr << "Failed to read page " << pageNr << " of '" << inputFile << "'\n";
+				return 1;
+			}
+
+			parse(pageBuf.data(), pageBuf.size(), 0, printFlags);
+		}
+
+		return 0;
+	}
+
 	char buf[100000] = {0};
 
 	std::ifstream in{parser.value("input"), std::ifstream::binary};
@@ -273,10 +319,6 @@ int main(int argc, char **argv)
 
 	uint8_t parseFlags = ParseFlags::WithInvalidate;
 
-	uint8_t printFlags = 0;
-	if (parser.has("--no-data"))
-		printFlags |= PrintFlags::WithoutData;
-
 	parse(buf, in.gcount(), parseFlags, printFlags);
 
 	return 0;
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+
+namespace bp {
+
+// Finished requests kept in memory for a long-running process, bounded by their total size and evicted least recently
+// used first. Keys are spread over shards with a lock each, so render threads looking up different labels don't wait
+// for each other. Payloads are shared, a request being sent stays valid when it is evicted meanwhile.
+class PayloadCache {
+public:
+	using Payload = std::shared_ptr<const std::string>;
+
+	static constexpr size_t Shards = 16;
+
+	struct Counters {
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		uint64_t evictions = 0;
+		uint64_t entries = 0;
+		uint64_t bytes = 0;
+	};
+
+	// every shard gets an equal part of maxBytes, a payload larger than that isn't kept
+	explicit PayloadCache(uint64_t maxBytes) : m_shardBytes(maxBytes / Shards)
+	{
+	}
+
+	Payload get(const std::string &key)
+	{
+		auto &shard = shardOf(key);
+		std::lock_guard lock{shard.mutex};
+		auto it = shard.entries.find(key);
+		if (it == shard.entries.end()) {
+			++shard.misses;
+			return nullptr;
+		}
+		shard.order.splice(shard.order.begin(), shard.order, it->second);
+		++shard.hits;
+		return it->second->payload;
+	}
+
+	void put(const std::string &key, Payload payload)
+	{
+		if (!payload || payload->size() > m_shardBytes)
+			return;
+
+		auto &shard = shardOf(key);
+		std::lock_guard lock{shard.mutex};
+		if (auto it = shard.entries.find(key); it != shard.entries.end()) {
+			shard.bytes -= it->second->payload->size();
+			shard.order.erase(it->second);
+			shard.entries.erase(it);
+		}
+		shard.bytes += payload->size();
+		shard.order.push_front(Entry{key, std::move(payload)});
+		shard.entries.emplace(key, shard.order.begin());
+
+		while (shard.bytes > m_shardBytes) {
+			auto &oldest = shard.order.back();
+			shard.bytes -= oldest.payload->size();
+			shard.entries.erase(oldest.key);
+			shard.order.pop_back();
+			++shard.evictions;
+		}
+	}
+
+	Counters counters() const
+	{
+		Counters counters;
+		for (auto &shard : m_shards) {
+			std::lock_guard lock{shard.mutex};
+			counters.hits += shard.hits;
+			counters.misses += shard.misses;
+			counters.evictions += shard.evictions;
+			counters.entries += shard.entries.size();
+			counters.bytes += shard.bytes;
+		}
+		return counters;
+	}
+
+private:
+	struct Entry {
+		std::string key;
+		Payload payload;
+	};
+
+	struct alignas(64) Shard {
+		mutable std::mutex mutex;
+		std::list<Entry> order;  // most recently used first
+		std::unordered_map<std::string, std::list<Entry>::iterator> entries;
+		uint64_t bytes = 0;
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		uint64_t evictions = 0;
+	};
+
+	Shard & shardOf(const std::string &key)
+	{
+		return m_shards[std::hash<std::string>{}(key) % Shards];
+	}
+
+	uint64_t m_shardBytes;
+	Shard m_shards[Shards];
+};
+
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <streambuf>
+#include <thread>
+
+#include <unistd.h>
+
+#include "device.hpp"
+
+
+namespace bp {
+
+// lock-free single-producer/single-consumer ring, the slots are written and read in place
+template <class T, size_t N>
+class SpscRing {
+	static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+
+public:
+	// producer side: the slot to fill next, blocks while the consumer still holds all slots
+	T & acquireWrite()
+	{
+		size_t head = m_head.load(std::memory_order_relaxed);
+		size_t tail = m_tail.load(std::memory_order_acquire);
+		while (head - tail == N) {
+			m_tail.wait(tail, std::memory_order_acquire);
+			tail = m_tail.load(std::memory_order_acquire);
+		}
+		return m_slots[head & (N - 1)];
+	}
+
+	void publish()
+	{
+		m_head.fetch_add(1, std::memory_order_release);
+		m_events.fetch_add(1, std::memory_order_release);
+		m_events.notify_one();
+	}
+
+	// consumer side: the oldest published slot, nullptr once the ring is closed and empty
+	T * acquireRead()
+	{
+		size_t tail = m_tail.load(std::memory_order_relaxed);
+		for (;;) {
+			uint32_t events = m_events.load(std::memory_order_acquire);
+			if (m_head.load(std::memory_order_acquire) != tail)
+				return &m_slots[tail & (N - 1)];
+			if (m_closed.load(std::memory_order_acquire))
+				return nullptr;
+			m_events.wait(events, std::memory_order_acquire);
+		}
+	}
+
+	void release()
+	{
+		m_tail.fetch_add(1, std::memory_order_release);
+		m_tail.notify_one();
+	}
+
+	void close()
+	{
+		m_closed.store(true, std::memory_order_release);
+		m_events.fetch_add(1, std::memory_order_release);
+		m_events.notify_one();
+	}
+
+	size_t size() const
+	{
+		return m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_acquire);
+	}
+
+private:
+	T m_slots[N];
+	alignas(64) std::atomic<size_t> m_head = 0;
+	alignas(64) std::atomic<size_t> m_tail = 0;
+	alignas(64) std::atomic<uint32_t> m_events = 0;  // bumped on publish and close, the consumer sleeps on it
+	std::atomic<bool> m_closed = false;
+};
+
+// output stream buffer that renders into ring slots while a writer thread drains the filled ones to the descriptor,
+// so rasterizing chunk N + 1 overlaps with writing chunk N
+class PipelineBuf : public OutputBuf {
+public:
+	static const size_t ChunkSize = 1 << 16;
+	static const size_t Chunks = 4;
+
+	explicit PipelineBuf(int fd) : m_fd(fd)
+	{
+		startChunk();
+		m_writer = std::thread{[this] { drain(); }};
+	}
+
+	PipelineBuf(const PipelineBuf &) = delete;
+	PipelineBuf & operator=(const PipelineBuf &) = delete;
+
+	~PipelineBuf() override
+	{
+		finish();
+		::close(m_fd);
+	}
+
+	int fd() const
+	{
+		return m_fd;
+	}
+
+	bool finish() override
+	{
+		if (m_writer.joinable()) {
+			sync();
+			m_ring.close();
+			m_writer.join();
+		}
+		if (m_error.load(std::memory_order_acquire)) {
+			errno = m_error;
+			return false;
+		}
+		return true;
+	}
+
+protected:
+	pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override
+	{
+		if (off != 0 || dir != std::ios_base::cur || !(which & std::ios_base::out))
+			return pos_type(off_type(-1));
+		return pos_type(m_written + (pptr() - pbase()));
+	}
+
+	int_type overflow(int_type c) override
+	{
+		if (sync() < 0)
+			return traits_type::eof();
+		if (!traits_type::eq_int_type(c, traits_type::eof())) {
+			*pptr() = traits_type::to_char_type(c);
+			pbump(1);
+		}
+		return traits_type::not_eof(c);
+	}
+
+	int sync() override
+	{
+		if (!m_writer.joinable())
+			return -1;
+		if (m_error.load(std::memory_order_acquire)) {
+			errno = m_error;
+			return -1;
+		}
+		if (pptr() == pbase())
+			return 0;
+
+		m_chunk->size = pptr() - pbase();
+		m_written += m_chunk->size;
+		m_ring.publish();
+		startChunk();
+		return 0;
+	}
+
+private:
+	struct Chunk {
+		size_t size;
+		char data[ChunkSize];
+	};
+
+	void startChunk()
+	{
+		m_chunk = &m_ring.acquireWrite();
+		setp(m_chunk->data, m_chunk->data + ChunkSize);
+	}
+
+	void drain()
+	{
+		while (Chunk *chunk = m_ring.acquireRead()) {
+			if (!m_error.load(std::memory_order_relaxed) && !writeAll(m_fd, chunk->data, chunk->size))
+				m_error.store(errno, std::memory_order_release);
+			m_ring.release();
+		}
+	}
+
+	int m_fd;
+	SpscRing<Chunk, Chunks> m_ring;
+	Chunk *m_chunk = nullptr;
+	off_type m_written = 0;
+	std::atomic<int> m_error = 0;
+	std::thread m_writer;
+};
+
+}
@@ -0,0 +1,479 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <csignal>
+#include <cstring>
+#include <fstream>
+#include <format>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "ArgParser.hpp"
+#include "commands.hpp"
+#include "device.hpp"
+#include "discovery.hpp"
+#include "job_options.hpp"
+#include "job_server.hpp"
+#include "json.hpp"
+#include "payload_cache.hpp"
+#include "render_cache.hpp"
+#include "runner.hpp"
+#include "status.hpp"
+
+
+static const char *DefaultCachePath = "/tmp/ptouch-printers";
+
+// --render-cache-size is in MiB
+static uint64_t renderCacheSize(const ArgParser &parser)
+{
+	return parser.has("--render-cache-size") ? std::stoull(parser.value("--render-cache-size")) << 20 : bp::RenderCache::DefaultMaxBytes;
+}
+
+// probes every /dev/usb/lp* and the --tcp printers in parallel and lists what they hold
+int discover(const ArgParser &parser)
+{
+	std::chrono::milliseconds timeout{parser.has("--timeout") ? std::stoi(parser.value("--timeout")) : 500};
+	std::chrono::seconds ttl{parser.has("--ttl") ? std::stoi(parser.value("--ttl")) : 60};
+	if (parser.has("--refresh"))
+		ttl = std::chrono::seconds{0};
+	auto cachePath = parser.has("--cache") ? parser.value("--cache") : DefaultCachePath;
+
+	StatusFormat format = StatusFormat::Text;
+	if (parser.has("--format") && (!parseStatusFormat(parser.value("--format"), format) || format == StatusFormat::Binary)) {
+		std::cerr << "Invalid format: " << parser.value("--format") << "\n";
+		return 1;
+	}
+
+	auto paths = parser.has("-d") ? parser.values("-d") : bp::localPrinters();
+	if (parser.has("--tcp")) {
+		for (const auto &address : parser.values("--tcp"))
+			paths.push_back(std::string{bp::TcpPrefix} + address);
+	}
+	if (paths.empty()) {
+		std::cerr << "No printers found\n";
+		return 1;
+	}
+
+	auto printers = bp::discoverPrinters(paths, timeout, cachePath, ttl);
+	int64_t now = bp::unixNow();
+	bool anyOnline = false;
+	for (const auto &printer : printers) {
+		if (format == StatusFormat::Json)
+			bp::printPrinterJson(std::cout, printer, now);
+		else
+			bp::printPrinter(std::cout, printer, now);
+		anyOnline = anyOnline || printer.online;
+	}
+
+	return anyOnline ? 0 : 1;
+}
+
+// the checks manage.py's verify_args did, error message if the printer can't take the job now
+static std::string checkPrinter(const Status &status, const JobSettings &settings)
+{
+	if (!status.errors().empty())
+		return std::format("Error: {}", status.errorStr());
+	if (status.phaseStr() != "editing state")
+		return "Printer must be in 'editing state' phase";
+	return bp::checkMedia(status, settings);
+}
+
+// what manage.py print did with a handful of processes and a temp file: drain, status, check the media, initialise
+// and print, then wait for the printer to report the label as done
+int print(const ArgParser &parser)
+{
+	JobSettings settings;
+	settings.image = parser.value("-i");
+	if (auto error = parseJobOptions(parser, settings); !error.empty()) {
+		std::cerr << error << "\n";
+		return 1;
+	}
+	if (!parser.has("--tape-type")) {
+		std::cerr << "Missing --tape-type\n";
+		return 1;
+	}
+	if (settings.image != "test" && ::access(settings.image.c_str(), F_OK) < 0) {
+		std::cerr << "Path " << settings.image << " does not exist\n";
+		return 1;
+	}
+	settings.tapeColour = parser.value("--tape-colour");
+	settings.textColour = parser.value("--text-colour");
+
+	std::chrono::milliseconds timeout{parser.has("--timeout") ? std::stoi(parser.value("--timeout")) : 500};
+	int attempts = parser.has("--attempts") ? std::stoi(parser.value("--attempts")) : 5;
+	std::chrono::milliseconds jobTimeout{parser.has("--job-timeout") ? std::stoi(parser.value("--job-timeout")) : 60000};
+	std::chrono::milliseconds resumeTimeout{parser.has("--resume-timeout") ? std::stoi(parser.value("--resume-timeout")) : 30000};
+
+	auto start = std::chrono::steady_clock::now();
+	std::string device;
+	if (parser.has("-d")) {
+		device = parser.value("-d");
+	} else {
+		auto cachePath = parser.has("--cache") ? parser.value("--cache") : DefaultCachePath;
+		for (const auto &printer : bp::discoverPrinters(bp::localPrinters(), timeout, cachePath, std::chrono::seconds{60})) {
+			if (printer.online && checkPrinter(printer.status, settings).empty()) {
+				device = printer.path;
+				break;
+			}
+		}
+		if (device.empty()) {
+			std::cerr << "No matching printer found\n";
+			return 1;
+		}
+	}
+
+	int fd = bp::openOutput(device, O_RDWR);
+	if (fd < 0) {
+		std::cerr << "Failed to open '" << device << "': " << std::strerror(errno) << "\n";
+		return 1;
+	}
+	// replies to earlier requests would be taken for the answer to ours
+	if (bp::drainInput(fd) < 0) {
+		std::cerr << "Failed to drain '" << device << "': " << std::strerror(errno) << "\n";
+		return 1;
+	}
+
+	bp::JobRunner runner{device, fd, jobTimeout, resumeTimeout};
+	std::optional<Status> status;
+	for (int i = 0; i < attempts && !status; ++i)
+		status = runner.requestStatus(timeout);
+	if (!status) {
+		std::cerr << "Failed to read printer status: " << (errno == ETIMEDOUT ? "no status reply" : std::strerror(errno)) << "\n";
+		return 1;
+	}
+	if (parser.has("--verbose"))
+		printStatus(std::cout, *status);
+	if (auto error = checkPrinter(*status, settings); !error.empty()) {
+		std::cerr << error << "\n";
+		return 1;
+	}
+	auto checked = std::chrono::steady_clock::now();
+
+	// rendered straight into memory, no request file in between
+	std::unique_ptr<bp::RenderCache> cache;
+	if (parser.has("--render-cache"))
+		cache = std::make_unique<bp::RenderCache>(parser.value("--render-cache"), renderCacheSize(parser));
+	auto job = bp::renderJob(settings, 0, cache.get());
+	if (!job.error.empty()) {
+		std::cerr << job.error << "\n";
+		return 1;
+	}
+	if (!bp::writeStruct(fd, InitCommand{})) {
+		std::cerr << "Failed to initialise '" << device << "': " << std::strerror(errno) << "\n";
+		return 1;
+	}
+
+	bp::JobRunner::Timing timing;
+	if (auto error = runner.print(job, timing); !error.empty()) {
+		std::cerr << "Failed to print: " << error << "\n";
+		return 1;
+	}
+	::close(fd);
+
+	auto ms = [](auto d) { return std::chrono::duration_cast<std::chrono::milliseconds>(d).count(); };
+	std::cerr << std::format("{}: checked in {} ms, {} in {} ms, sent in {} ms, printed in {} ms\n",
+		device, ms(checked - start), job.cached ? "cached" : "rendered", ms(timing.render), ms(timing.send), ms(timing.print));
+
+	return 0;
+}
+
+// what run and serve print with: the printers, the caches and the scheduler spreading the jobs over them
+struct PrintService {
+	std::vector<std::unique_ptr<bp::JobRunner>> runners;
+	std::unique_ptr<bp::RenderCache> cache;
+	std::unique_ptr<bp::PayloadCache> memory;  // only for a long-running process
+	std::unique_ptr<bp::JobScheduler> scheduler;
+};
+
+// false if the printers can't be used, the reason is on stderr then
+static bool openService(const ArgParser &parser, bool longRunning, PrintService &service)
+{
+	std::chrono::milliseconds timeout{parser.has("--timeout") ? std::stoi(parser.value("--timeout")) : 500};
+	std::chrono::milliseconds jobTimeout{parser.has("--job-timeout") ? std::stoi(parser.value("--job-timeout")) : 60000};
+	std::chrono::milliseconds resumeTimeout{parser.has("--resume-timeout") ? std::stoi(parser.value("--resume-timeout")) : 30000};
+
+	std::chrono::seconds thermalWindow{parser.has("--thermal-window") ? std::stoi(parser.value("--thermal-window")) : 60};
+	double thermalLimit = parser.has("--thermal-limit") ? std::stod(parser.value("--thermal-limit")) : 0;
+
+	// printers found on their own that can't be used are left out, the ones asked for with -d have to work
+	bool discovered = !parser.has("-d");
+	for (const auto &device : discovered ? bp::localPrinters() : parser.values("-d")) {
+		int fd = bp::openOutput(device, O_RDWR);
+		if (fd < 0) {
+			std::cerr << "Failed to open '" << device << "': " << std::strerror(errno) << "\n";
+			if (discovered)
+				continue;
+			return false;
+		}
+		if (parser.has("--initialise") && !bp::writeStruct(fd, InitCommand{})) {
+			std::cerr << "Failed to initialise '" << device << "': " << std::strerror(errno) << "\n";
+			::close(fd);
+			if (discovered)
+				continue;
+			return false;
+		}
+
+		auto runner = std::make_unique<bp::JobRunner>(device, fd, jobTimeout, resumeTimeout, bp::ThermalModel{thermalWindow, thermalLimit});
+		if (auto error = runner->checkReady(timeout); !error.empty()) {
+			std::cerr << "Printer '" << device << "': " << error << "\n";
+			::close(fd);
+			if (discovered)
+				continue;
+			return false;
+		}
+		auto status = *runner->status();
+		std::cerr << std::format("{}: {} {}, {} on {}\n", device, status.mediaWidthStr(), status.mediaTypeStr(),
+			status.textColourStr(), status.tapeColourStr());
+		service.runners.push_back(std::move(runner));
+	}
+	if (service.runners.empty()) {
+		std::cerr << "No printers found\n";
+		return false;
+	}
+
+	std::vector<bp::JobRunner *> printers;
+	for (auto &runner : service.runners)
+		printers.push_back(runner.get());
+	size_t renderWorkers = parser.has("--render-workers") ? std::stoul(parser.value("--render-workers")) : std::max(std::thread::hardware_concurrency(), 1u);
+	if (parser.has("--render-cache"))
+		service.cache = std::make_unique<bp::RenderCache>(parser.value("--render-cache"), renderCacheSize(parser));
+	uint64_t memoryCacheSize = parser.has("--memory-cache-size") ? std::stoull(parser.value("--memory-cache-size")) : 64;
+	if (longRunning && memoryCacheSize > 0)
+		service.memory = std::make_unique<bp::PayloadCache>(memoryCacheSize << 20);
+	service.scheduler = std::make_unique<bp::JobScheduler>(printers, renderWorkers, service.cache.get(), service.memory.get());
+	return true;
+}
+
+// prints every -i image as a job of its own on one of the -d printers (all attached ones by default) that holds matching
+// media, rendering the next ones while the printers work; with --manifest it keeps taking jobs from a JSON Lines stream
+// until it ends
+int run(const ArgParser &parser)
+{
+	JobSettings settings;
+	if (auto error = parseJobOptions(parser, settings); !error.empty()) {
+		std::cerr << error << "\n";
+		return 1;
+	}
+	if (parser.has("--tape-colour"))
+		settings.tapeColour = parser.value("--tape-colour");
+	if (parser.has("--text-colour"))
+		settings.textColour = parser.value("--text-colour");
+	if (parser.has("--manifest") == parser.has("-i")) {
+		std::cerr << "Either -i or --manifest is needed\n";
+		return 1;
+	}
+	if (parser.has("-i") && settings.tapeWidth.empty()) {
+		std::cerr << "Missing argument: '--tape-width'\n";
+		return 1;
+	}
+	std::vector<JobSettings> jobs;
+	if (parser.has("-i")) {
+		for (const auto &image : parser.values("-i")) {
+			jobs.push_back(settings);
+			jobs.back().image = image;
+		}
+	}
+
+	PrintService service;
+	if (!openService(parser, parser.has("--manifest"), service))
+		return 1;
+	auto &scheduler = *service.scheduler;
+
+	if (!parser.has("--manifest")) {
+		if (auto error = scheduler.run(jobs, std::cerr); !error.empty()) {
+			std::cerr << "Failed to print: " << error << "\n";
+			return 1;
+		}
+		return 0;
+	}
+
+	// lines that arrive together are run together, a failed job doesn't stop the ones after it
+	const auto &manifestFile = parser.value("--manifest");
+	std::ifstream file;
+	if (manifestFile == "-") {
+		std::ios::sync_with_stdio(false);
+	} else if (file.open(manifestFile); !file) {
+		std::cerr << "Failed to open '" << manifestFile << "': " << std::strerror(errno) << "\n";
+		return 1;
+	}
+	std::istream &in = manifestFile == "-" ? std::cin : file;
+	std::atomic<bool> failed = false;
+	std::vector<unsigned> lineNrs;  // of the jobs
+	scheduler.setListener([&](size_t index, bp::JobEvent event, std::string_view error) {
+		if (event != bp::JobEvent::Failed)
+			return;
+		std::cerr << std::format("{}: line {}: {}: {}\n", manifestFile, lineNrs[index], jobs[index].image, error);
+		failed = true;
+	});
+	std::string line;
+	bp::JsonObject object;
+	for (unsigned lineNr = 1; std::getline(in, line); ++lineNr) {
+		jobs.clear();
+		lineNrs.clear();
+		do {
+			if (line.find_first_not_of(" \t\r") == std::string::npos)
+				continue;
+			JobSettings job = settings;
+			auto error = bp::readJsonObject(line, object);
+			if (error.empty())
+				error = parseJobObject(object, job);
+			if (!error.empty()) {
+				std::cerr << manifestFile << ": line " << lineNr << ": " << error << "\n";
+				failed = true;
+				continue;
+			}
+			jobs.push_back(std::move(job));
+			lineNrs.push_back(lineNr);
+		} while (in.rdbuf()->in_avail() > 0 && std::getline(in, line) && ++lineNr);
+
+		if (jobs.empty())
+			continue;
+		if (auto error = scheduler.run(jobs, std::cerr); !error.empty()) {
+			std::cerr << "Failed to print: " << error << "\n";
+			failed = true;
+		}
+	}
+
+	return failed ? 1 : 0;
+}
+
+static volatile std::sig_atomic_t stopRequested = 0;
+
+// takes jobs over a Unix socket until SIGINT or SIGTERM, printing them like run does; the job options are the defaults
+// for the jobs that don't set them
+int serve(const ArgParser &parser)
+{
+	JobSettings settings;
+	if (auto error = parseJobOptions(parser, settings); !error.empty()) {
+		std::cerr << error << "\n";
+		return 1;
+	}
+	if (parser.has("--tape-colour"))
+		settings.tapeColour = parser.value("--tape-colour");
+	if (parser.has("--text-colour"))
+		settings.textColour = parser.value("--text-colour");
+
+	PrintService service;
+	if (!openService(parser, true, service))
+		return 1;
+
+	bp::JobServer server{*service.scheduler, settings, std::cerr};
+	if (auto error = server.listen(parser.value("--socket")); !error.empty()) {
+		std::cerr << "Failed to serve: " << error << "\n";
+		return 1;
+	}
+	std::signal(SIGINT, [](int) { stopRequested = 1; });
+	std::signal(SIGTERM, [](int) { stopRequested = 1; });
+	std::cerr << "Listening on '" << parser.value("--socket") << "'\n";
+	server.serve(stopRequested);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	enum class Command {
+		Discover,
+		Print,
+		Run,
+		Serve,
+	} command;
+
+	if (argc > 1 && strcmp(argv[1], "discover") == 0)
+		command = Command::Discover;
+	else if (argc > 1 && strcmp(argv[1], "print") == 0)
+		command = Command::Print;
+	else if (argc > 1 && strcmp(argv[1], "run") == 0)
+		command = Command::Run;
+	else if (argc > 1 && strcmp(argv[1], "serve") == 0)
+		command = Command::Serve;
+	else
+		assert(false);
+
+	ArgParser parser;
+	switch (command) {
+		case Command::Discover:
+			parser.addArgument(Arg{"-d"}.setOptional().setRepeatable());
+			parser.addArgument(Arg{"--tcp"}.setOptional().setRepeatable());
+			parser.addArgument(Arg{"--timeout"}.setOptional());
+			parser.addArgument(Arg{"--cache"}.setOptional());
+			parser.addArgument(Arg{"--ttl"}.setOptional());
+			parser.addArgument(Arg{"--refresh"}.setOptional().setCount(0));
+			parser.addArgument(Arg{"--format"}.setOptional());
+			break;
+		case Command::Print:
+			parser.addArgument(Arg{"-d"}.setOptional());
+			parser.addArgument(Arg{"-i"});
+			addJobOptions(parser);
+			parser.addArgument(Arg{"--tape-colour"});
+			parser.addArgument(Arg{"--text-colour"});
+			parser.addArgument(Arg{"--cache"}.setOptional());
+			parser.addArgument(Arg{"--timeout"}.setOptional());
+			parser.addArgument(Arg{"--attempts"}.setOptional());
+			parser.addArgument(Arg{"--job-timeout"}.setOptional());
+			parser.addArgument(Arg{"--resume-timeout"}.setOptional());
+			parser.addArgument(Arg{"--verbose"}.setOptional().setCount(0));
+			parser.addArgument(Arg{"--render-cache"}.setOptional());
+			parser.addArgument(Arg{"--render-cache-size"}.setOptional());
+			break;
+		case Command::Run:
+			parser.addArgument(Arg{"-d"}.setOptional().setRepeatable());
+			parser.addArgument(Arg{"-i"}.setOptional().setRepeatable());
+			parser.addArgument(Arg{"--manifest"}.setOptional());
+			addJobOptions(parser, false);
+			parser.addArgument(Arg{"--tape-colour"}.setOptional());
+			parser.addArgument(Arg{"--text-colour"}.setOptional());
+			parser.addArgument(Arg{"--initialise"}.setOptional().setCount(0));
+			parser.addArgument(Arg{"--timeout"}.setOptional());
+			parser.addArgument(Arg{"--job-timeout"}.setOptional());
+			parser.addArgument(Arg{"--resume-timeout"}.setOptional());
+			parser.addArgument(Arg{"--thermal-window"}.setOptional());
+			parser.addArgument(Arg{"--thermal-limit"}.setOptional());
+			parser.addArgument(Arg{"--render-workers"}.setOptional());
+			parser.addArgument(Arg{"--render-cache"}.setOptional());
+			parser.addArgument(Arg{"--render-cache-size"}.setOptional());
+			parser.addArgument(Arg{"--memory-cache-size"}.setOptional());
+			break;
+		case Command::Serve:
+			parser.addArgument(Arg{"--socket"});
+			parser.addArgument(Arg{"-d"}.setOptional().setRepeatable());
+			addJobOptions(parser, false);
+			parser.addArgument(Arg{"--tape-colour"}.setOptional());
+			parser.addArgument(Arg{"--text-colour"}.setOptional());
+			parser.addArgument(Arg{"--initialise"}.setOptional().setCount(0));
+			parser.addArgument(Arg{"--timeout"}.setOptional());
+			parser.addArgument(Arg{"--job-timeout"}.setOptional());
+			parser.addArgument(Arg{"--resume-timeout"}.setOptional());
+			parser.addArgument(Arg{"--thermal-window"}.setOptional());
+			parser.addArgument(Arg{"--thermal-limit"}.setOptional());
+			parser.addArgument(Arg{"--render-workers"}.setOptional());
+			parser.addArgument(Arg{"--render-cache"}.setOptional());
+			parser.addArgument(Arg{"--render-cache-size"}.setOptional());
+			parser.addArgument(Arg{"--memory-cache-size"}.setOptional());
+			break;
+	}
+
+	parser.parse(argc - 2, argv + 2);
+	if (!parser.isValid()) {
+		std::cerr << parser.getErrorMsg() << "\n";
+		return 1;
+	}
+
+	switch (command) {
+		case Command::Discover:
+			return discover(parser);
+		case Command::Print:
+			return print(parser);
+		case Command::Run:
+			return run(parser);
+		case Command::Serve:
+			return serve(parser);
+	}
+
+	return 0;
+}
@@ -0,0 +1,96 @@
+#ifndef PTOUCH_H
+#define PTOUCH_H
+
+/*
+ * libptouch: builds print requests for Brother P-touch P900/P900W/P950NW printers from pixels in memory and decodes
+ * their status frames, for programs that would otherwise run make_request. Plain C, callable through ctypes or cgo.
+ *
+ * Functions returning int give 0 on success and -1 on failure, ptouch_last_error() then tells why (per thread).
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PTOUCH_API __attribute__((visibility("default")))
+
+#define PTOUCH_STATUS_SIZE 32
+
+enum ptouch_pixel_format {
+	PTOUCH_GRAY8 = 0,
+	PTOUCH_RGB8 = 1,
+	PTOUCH_RGBA8 = 2, /* alpha is ignored */
+	PTOUCH_MONO1 = 3, /* 8 pixels a byte, the first in the high bit, a set bit is black */
+};
+
+/* Read in place, nothing is copied. Rows run along the tape, so height has to fit the tape width (see ptouch_tape_height). */
+struct ptouch_pixels {
+	const uint8_t *data;
+	uint32_t width;
+	uint32_t height;
+	size_t stride; /* bytes from one row to the next */
+	int format; /* enum ptouch_pixel_format */
+};
+
+/* the options of make_request print, ptouch_job_init() sets the same defaults */
+struct ptouch_job {
+	const char *tape_width; /* such as "12 mm" */
+	unsigned copies;
+	unsigned length_margin; /* mm */
+	int compressed;
+	int auto_cut;
+	int half_cut;
+	int chain_printing;
+	int mirror_printing;
+	int center; /* centers a lower image on the tape */
+	int test_page; /* prints the test pattern, the pixels are not used */
+};
+
+/* a printer status frame in words, the strings are those of read_status */
+struct ptouch_status {
+	int status_type;
+	int phase_type;
+	int notification;
+	uint16_t error_bits;
+	int ready; /* no error and waiting for a job */
+	char model[32];
+	char battery_level[32];
+	char errors[256];
+	char media_width[64];
+	char media_type[64];
+	char status[64];
+	char phase[64];
+	char notification_name[64];
+	char tape_colour[64];
+	char text_colour[64];
+};
+
+PTOUCH_API const char *ptouch_last_error(void);
+
+PTOUCH_API void ptouch_job_init(struct ptouch_job *job);
+
+/* pixels an image may have across the tape, -1 for an unknown tape width */
+PTOUCH_API int ptouch_tape_height(const char *tape_width);
+
+/* the complete print request in a buffer from malloc, to be released with ptouch_free */
+PTOUCH_API int ptouch_render(const struct ptouch_job *job, const struct ptouch_pixels *pixels, uint8_t **data, size_t *size);
+
+/* writes the print request to the descriptor (a printer, a socket, a file) while it is being rendered */
+PTOUCH_API int ptouch_render_fd(const struct ptouch_job *job, const struct ptouch_pixels *pixels, int fd);
+
+PTOUCH_API void ptouch_free(void *data);
+
+/* the invalidate and initialise command (ESC @) and the status request (ESC i S), returns the bytes needed */
+PTOUCH_API size_t ptouch_init_command(uint8_t *buffer, size_t size);
+PTOUCH_API size_t ptouch_status_request(uint8_t *buffer, size_t size);
+
+PTOUCH_API int ptouch_decode_status(const uint8_t *frame, size_t size, struct ptouch_status *status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
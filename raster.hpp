@@ -0,0 +1,507 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <iostream>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+#include "png++/png.hpp"
+
+#include "commands.hpp"
+#include "constants.hpp"
+#include "scaling.hpp"
+#include "spool.hpp"
+
+
+// Turns an image into the raster commands of a print request. Used by make_request, the ptouch runner and libptouch.
+
+// everything a print request is made of except for the image itself
+struct JobSettings {
+	std::string image;  // png file or "test"
+	std::string tapeWidth;
+	std::string tapeType;
+	std::string tapeColour;  // only to pick a printer loaded with it, empty for any
+	std::string textColour;
+	unsigned copies = 1;
+	unsigned lengthMargin = 14;  // mm
+	bool compressed = true;
+	bool autoCut = true;
+	bool halfCut = true;
+	bool chainPrinting = false;
+	bool mirrorPrinting = false;
+	bool scaleDown = false;
+	bool scaleUp = false;
+	bool center = false;
+};
+
+inline void writeEncodedLine(std::ostream &out, uint8_t* line, png::uint_32 height)
+{
+	// std::cerr << "print line: ";
+	// for (png::uint_32 i = 0; i < height; ++i)
+		// std::cerr << std::hex << std::setfill('0') << std::setw(2) << static_cast<uint32_t>(static_cast<uint8_t>(line[i]));
+	// std::cerr << "\n";
+
+	static const png::uint_32 AuxSize = 20;
+
+	uint8_t output[height + 3 + AuxSize];
+	size_t size = 3, counter = 1;
+	uint8_t last = -1;
+
+	uint8_t buffer[height];
+	size_t bufferSize = 0;
+
+	for (png::uint_32 y = 0; y < height; ++y) {
+		if (line[y] == last && y != 0) {
+			if (bufferSize > 1) {
+				output[size++] = bufferSize - 2;
+				// std::cerr << "write buffer (" << bufferSize - 1 << "): ";
+				for (size_t i = 0; i < bufferSize - 1; ++i) {
+					output[size++] = buffer[i];
+					// std::cerr << std::hex << std::setfill('0') << std::setw(2) << static_cast<uint32_t>(static_cast<uint8_t>(buffer[i]));
+				}
+				// std::cerr << "\n";
+				buffer[0] = line[y];
+				bufferSize = 1;
+				assert(counter == 1);
+			}
+			++counter;
+
+		} else {
+			if (counter > 1) {
+				output[size++] = -(counter - 1);
+				output[size++] = buffer[0];
+				// std::cerr << "write repeated (" << std::hex << static_cast<uint32_t>(static_cast<uint8_t>(buffer[0])) << ") x " << std::dec << counter << "\n";
+
+				buffer[0] = line[y];
+				counter = 1;
+				assert(bufferSize == 1);
+				bufferSize = 0;
+			}
+			buffer[bufferSize++] = line[y];
+			last = line[y];
+		}
+	}
+	if (bufferSize > 1) {
+		output[size++] = bufferSize - 1;
+		// std::cerr << "write buffer (" << bufferSize << "): ";
+		for (size_t i = 0; i < bufferSize; ++i) {
+			output[size++] = buffer[i];
+			// std::cerr << std::hex << std::setfill('0') << std::setw(2) << static_cast<uint32_t>(static_cast<uint8_t>(buffer[i]));
+		}
+		// std::cerr << "\n";
+	} else {
+		output[size++] = -(counter - 1);
+		output[size++] = buffer[0];
+		// std::cerr << "write repeated (" << std::hex << static_cast<uint32_t>(static_cast<uint8_t>(buffer[0])) << ") x " << std::dec << counter << "\n";
+	}
+
+	output[0] = 'G';
+	output[1] = size - 3;
+	output[2] = 0;
+	// std::cerr << "buffer:     ";
+	for (size_t i = 0; i < size; ++i) {
+		// std::cerr << std::hex << std::setfill('0') << std::setw(2) << static_cast<uint32_t>(static_cast<uint8_t>(output[i]));
+		out << output[i];
+	}
+	// std::cerr << "\n\n";
+}
+
+struct Flags {
+	enum Value : uint8_t {
+		Compressed = 0x01,
+		Center = 0x02,
+		Stream = 0x04,
+		Test = 0x80,
+	};
+};
+
+static const unsigned TestImageWidth = 16 * 8;
+
+// in streaming mode the rasterized data is handed over to the output every this many image columns
+static const unsigned StreamChunkColumns = 32;
+
+struct Exec {
+	std::string error;
+
+	inline operator bool() const { return error.empty(); }
+};
+
+namespace {
+	// uint16_t randomMask(uint8_t bitsOn)
+	// {
+	// 	static auto rng = std::default_random_engine{};
+	//
+	// 	unsigned mask[16];
+	// 	for (unsigned i = 0; i < 16; ++i)
+	// 		mask[i] = i;
+	// 	std::ranges::shuffle(mask, rng);
+	//
+	// 	uint16_t p = 0;
+	// 	for (uint8_t i = 0; i < bitsOn; ++i)
+	// 		p |= 1 << mask[i];
+	// 	return p;
+	// };
+	//
+	// uint16_t patternMask(uint8_t bitsOn)
+	// {
+	// 	static const unsigned Mask[16] = {6, 9, 0, 15, 12, 3, 5, 10, 4, 11, 2, 13, 7, 8, 1, 14};
+	//
+	// 	uint16_t p = 0;
+	// 	for (uint8_t i = 0; i < bitsOn; ++i)
+	// 		p |= 1 << Mask[i];
+	// 	return p;
+	// };
+}
+
+// Alternates between the mask and its transpose from one pixel to the next. The state belongs to one request, so a
+// request renders the same no matter what was rendered before it in the process.
+struct AlternatingPatternMask {
+	bool transpose = false;
+
+	uint16_t operator()(uint8_t bitsOn)
+	{
+		static const unsigned Mask[16] = {6, 9, 0, 15, 12, 3, 5, 10, 4, 11, 2, 13, 7, 8, 1, 14};
+
+		uint16_t p = 0;
+		for (uint8_t i = 0; i < 4; ++i) {
+			for (uint8_t j = 0; j < 4; ++j) {
+				if (transpose) {
+					if (i * 4 + j < bitsOn)
+						p |= 1 << Mask[4 * i + j];
+				} else {
+					if (j * 4 + i < bitsOn)
+						p |= 1 << Mask[4 * j + i];
+				}
+			}
+		}
+
+		transpose = !transpose;
+
+		return p;
+	}
+};
+
+// pixels somebody else owns (such as a caller of libptouch), read in place with the interface of png::image
+struct PixelView {
+	enum Format : uint8_t {
+		Gray8,
+		Rgb8,
+		Rgba8,  // alpha is ignored, as when png++ reads such a file as rgb
+		Mono1,  // 8 pixels a byte, the first in the high bit, a set bit is black
+	};
+
+	const uint8_t *data;
+	png::uint_32 width;
+	png::uint_32 height;
+	size_t stride;  // bytes from one row to the next
+	Format format;
+
+	// bytes a row of the pixels takes up at least
+	static size_t rowSize(Format format, png::uint_32 width)
+	{
+		switch (format) {
+			case Gray8:
+				return width;
+			case Rgb8:
+				return size_t{3} * width;
+			case Rgba8:
+				return size_t{4} * width;
+			case Mono1:
+				return (size_t{width} + 7) / 8;
+		}
+		return 0;
+	}
+
+	png::uint_32 get_width() const
+	{
+		return width;
+	}
+
+	png::uint_32 get_height() const
+	{
+		return height;
+	}
+
+	png::rgb_pixel get_pixel(png::uint_32 x, png::uint_32 y) const
+	{
+		const uint8_t *row = data + y * stride;
+		switch (format) {
+			case Gray8:
+				return png::rgb_pixel{row[x], row[x], row[x]};
+			case Rgb8:
+				return png::rgb_pixel{row[3 * x], row[3 * x + 1], row[3 * x + 2]};
+			case Rgba8:
+				return png::rgb_pixel{row[4 * x], row[4 * x + 1], row[4 * x + 2]};
+			case Mono1: {
+				uint8_t v = (row[x / 8] >> (7 - x % 8)) & 1 ? 0 : 255;
+				return png::rgb_pixel{v, v, v};
+			}
+		}
+		return {};
+	}
+};
+
+struct Margins {
+	unsigned leftMargin;
+	unsigned rightMargin;
+	unsigned height;  // pixels
+
+	static const unsigned Pins = 560;
+
+	Margins(std::string_view mediaWidth)
+	{
+		const auto margin = bp::margins().at(mediaWidth);
+		// left and right margins are swapped as the data is mirrored
+		leftMargin = margin.second;
+		rightMargin = margin.first;
+		rightMargin += 4 - (leftMargin + rightMargin) % 4;  // adjust to full bytes
+		height = (Pins - leftMargin - rightMargin) / 4;
+	}
+};
+
+// Image is a png::image<png::rgb_pixel> or a PixelView
+template <class Image>
+Exec writePng(std::ostream &out, const Image &img, std::string_view mediaWidth, unsigned imageWidth, uint8_t flags, AlternatingPatternMask &maskFn)
+{
+	static const unsigned Height = 70;
+
+	if (!bp::margins().contains(mediaWidth))
+		return Exec{std::format("writePng: unrecognised media width {}", mediaWidth)};
+
+	Margins margins{mediaWidth};
+	unsigned leftMargin = margins.leftMargin;
+	unsigned rightMargin = margins.rightMargin;
+
+	png::uint_32 width = imageWidth;
+	png::uint_32 height = margins.height;
+	if (!(flags & Flags::Test))
+		height = img.get_height();
+
+	// in 64 bits, a height from a caller could wrap around
+	uint64_t heightPins = uint64_t{height} * 4;
+	if (Margins::Pins < leftMargin + heightPins + rightMargin)
+		return Exec{std::format("Height of the image too large: left margin = {} pins, right margin = {} pins, expected = {} pixels ({} pins), received {} pixels ({} pins)", rightMargin, leftMargin, (Margins::Pins - leftMargin - rightMargin) / 4, Margins::Pins - leftMargin - rightMargin, height, heightPins)};
+
+	if (flags & Flags::Center) {
+		leftMargin += (margins.height - height) * 4 / 2;
+		rightMargin += Margins::Pins - height * 4 - leftMargin - rightMargin;
+	}
+
+	if (Margins::Pins != leftMargin + heightPins + rightMargin)
+		return Exec{std::format("Height of the image doesn't match the tape: left margin = {} pins, right margin = {} pins, expected at most = {} pixels ({} pins), received {} pixels ({} pins)", rightMargin, leftMargin, (Margins::Pins - leftMargin - rightMargin) / 4, Margins::Pins - leftMargin - rightMargin, height, heightPins)};
+
+	uint8_t vline[4][Height];
+	bool zeroLine[4];
+
+	auto intensity = [](const png::basic_rgb_pixel<unsigned char> &p) { return 15 - (p.red + p.green + p.blue) / 3 / 16; };
+
+	for (png::uint_32 x = 0; x < width; ++x) {
+		std::memset(vline, 0, sizeof vline);
+		*(reinterpret_cast<uint32_t *>(zeroLine)) = 0;
+
+		for (png::uint_32 y = 0; y < height; ++y) {
+			uint16_t pixel;
+			if (flags & Flags::Test)
+				pixel = maskFn(x / 8 + 1);
+			else
+				pixel = maskFn(intensity(img.get_pixel(x, y)));
+
+			for (unsigned i = 0; i < 4; ++i) {
+				for (unsigned j = 0; j < 4; ++j) {
+					if (pixel & (1 << (4 * i + j))) {
+						unsigned pin = leftMargin + y * 4 + j;
+						unsigned byteNr = pin / 8;
+						unsigned bitInPixel = 7 - pin % 8;
+						vline[i][byteNr] |= 1 << bitInPixel;
+						zeroLine[i] = false;
+					}
+				}
+			}
+		}
+
+		for (unsigned i = 0; i < 4; ++i) {
+			if (zeroLine[i]) {
+				out << 'Z';
+			} else if (flags & Flags::Compressed) {
+				writeEncodedLine(out, vline[i], Height);
+			} else {
+				out << 'G' << static_cast<uint8_t>(70) << static_cast<uint8_t>(0);
+				for (png::uint_32 y = 0; y < Height; ++y)
+					out << vline[i][y];
+			}
+		}
+
+		if ((flags & Flags::Stream) && (x + 1) % StreamChunkColumns == 0)
+			out.flush();
+	}
+
+	return Exec{};
+}
+
+template <class Image>
+Exec writePrintRequest(std::ostream &out, const JobSettings &settings, const Image &image, unsigned imageWidth, uint8_t flags, bp::SpoolIndex *index = nullptr)
+{
+	// page offsets are relative to the end of the spool when the request started
+	uint64_t spoolBase = index ? index->spoolSize : 0;
+
+	const auto &tapeWidth = settings.tapeWidth;
+	if (!bp::tapeWidth().contains(tapeWidth))
+		return Exec(std::format("writePrintRequest: unrecognised tape width {}", tapeWidth));
+
+	AlternatingPatternMask mask;
+	unsigned copies = settings.copies;
+	for (unsigned copyIndex = 0; copyIndex < copies; ++copyIndex) {
+		uint64_t pageOffset = spoolBase + out.tellp();
+		writeStruct(out, SwitchDynamicCommandMode{});
+
+		PrintInformationCommand printInformationCommand;
+		printInformationCommand.mediaWidth = bp::tapeWidth().at(tapeWidth);
+		printInformationCommand.setRasterNumber(4 * imageWidth);
+		if (copyIndex + 1 == copies)
+			printInformationCommand.pageIndex = PrintInformationCommand::Last;
+		else if (copyIndex == 0)
+			printInformationCommand.pageIndex = PrintInformationCommand::Starting;
+		else
+			printInformationCommand.pageIndex = PrintInformationCommand::Other;
+		writeStruct(out, printInformationCommand);
+
+		VariousModeSettings variousModeSettings;
+		if (settings.autoCut)
+			variousModeSettings.v |= VariousModeSettings::AutoCut;
+		if (settings.mirrorPrinting)
+			variousModeSettings.v |= VariousModeSettings::MirrorPrinting;
+		writeStruct(out, variousModeSettings);
+
+		writeStruct(out, PageNumberInCutEachLabels{});
+
+		AdvancedModeSettings advancedModeSettings;
+		if (!settings.halfCut)
+			advancedModeSettings.halfCut = false;
+		if (settings.chainPrinting)
+			advancedModeSettings.noChainPrinting = false;
+		writeStruct(out, advancedModeSettings);
+
+		SpecifyMarginAmount specifyMarginAmount;
+		specifyMarginAmount.v[0] = settings.lengthMargin;
+		writeStruct(out, specifyMarginAmount);
+
+		SelectCompressionMode compressionMode;
+		if (flags & Flags::Compressed)
+			compressionMode.v = SelectCompressionMode::Tiff;
+		else
+			compressionMode.v = SelectCompressionMode::NoCompression;
+		writeStruct(out, compressionMode);
+
+		if (flags & Flags::Stream)
+			out.flush();  // let the printer start on the command preamble while the raster is computed
+
+		auto exec = writePng(out, image, tapeWidth, imageWidth, flags, mask);
+		if (!exec)
+			return exec;
+
+		uint8_t marker;
+		if (copyIndex + 1 < copies)
+			marker = 0x0c;  // page end marker
+		else
+			marker = 0x1a;  // final page marker
+		out << marker;
+
+		if (index) {
+			bp::SpoolPage page;
+			page.offset = pageOffset;
+			index->spoolSize = spoolBase + out.tellp();
+			page.size = index->spoolSize - pageOffset;
+			page.rasterCount = 4 * imageWidth;
+			page.pageIndexOffset = sizeof(SwitchDynamicCommandMode) + offsetof(PrintInformationCommand, pageIndex);
+			page.compression = compressionMode.v;
+			page.mediaType = printInformationCommand.mediaType;
+			page.mediaWidth = printInformationCommand.mediaWidth;
+			page.pageIndex = printInformationCommand.pageIndex;
+			page.marker = marker;
+			index->pages.push_back(page);
+		}
+	}
+
+	return Exec{};
+}
+
+inline png::image<png::rgb_pixel> enlargeImage(const png::image<png::rgb_pixel> &image)
+{
+	auto width = image.get_width();
+	auto height = image.get_height();
+	png::image<png::rgb_pixel> img{width * 2, height * 2};
+	for (png::uint_32 x = 0; x < width; ++x) {
+		for (png::uint_32 y = 0; y < height; ++y) {
+			const auto &pixel = image.get_pixel(y, x);
+			img.set_pixel(y * 2, x * 2, pixel);
+			img.set_pixel(y * 2 + 1, x * 2, pixel);
+			img.set_pixel(y * 2, x * 2 + 1, pixel);
+			img.set_pixel(y * 2 + 1, x * 2 + 1, pixel);
+		}
+	}
+
+	return img;
+}
+
+// the Flags for writePrintRequest that follow from the settings
+inline uint8_t jobFlags(const JobSettings &settings)
+{
+	uint8_t flags = 0;
+	if (settings.compressed)
+		flags |= Flags::Compressed;
+	if (settings.center)
+		flags |= Flags::Center;
+	return flags;
+}
+
+// reads the image (nothing for the test page), from png if given instead of the file, and scales it to the tape as the
+// settings ask for
+inline Exec loadImage(const JobSettings &settings, png::image<png::rgb_pixel> &image, unsigned &imageWidth, uint8_t &flags, std::istream *png = nullptr)
+{
+	flags = jobFlags(settings);
+
+	if (settings.image == "test" && !png) {
+		flags |= Flags::Test;
+		imageWidth = TestImageWidth;
+		return Exec{};
+	}
+	if (!bp::margins().contains(settings.tapeWidth))
+		return Exec{std::format("loadImage: unrecognised media width {}", settings.tapeWidth)};
+
+	try {
+		if (png)
+			image.read(*png);
+		else
+			image.read(settings.image);
+	} catch (const std::exception &e) {
+		return Exec{std::format("Failed to read '{}': {}", settings.image, e.what())};
+	}
+	imageWidth = image.get_width();
+
+	unsigned imageHeight = image.get_height();
+	if (settings.scaleUp) {
+		auto expectedHeight = Margins{settings.tapeWidth}.height;
+		while (imageHeight * 2 <= expectedHeight) {
+			std::cerr << std::format("height: {}, expected height: {}, enlarging image\n", imageHeight, expectedHeight);
+			image = enlargeImage(image);
+			imageHeight = image.get_height();
+			imageWidth = image.get_width();
+		}
+	}
+	if (settings.scaleDown) {
+		auto expectedHeight = Margins{settings.tapeWidth}.height;
+		auto expectedWidth = static_cast<unsigned>(static_cast<double>(expectedHeight) / static_cast<double>(imageHeight) * static_cast<double>(imageWidth));
+		static const unsigned FilterSize = 3;
+		if (imageHeight > expectedHeight) {
+			image = scaleLanczos(image, expectedHeight, expectedWidth, FilterSize);
+			imageHeight = image.get_height();
+			imageWidth = image.get_width();
+		}
+	}
+
+	return Exec{};
+}
@@ -1,349 +1,180 @@
 #include <cassert>
+#include <csignal>
+#include <cstring>
 #include <iomanip>
 #include <iostream>
 #include <fstream>
 #include <string_view>
 
-#include "ArgParser.hpp"
-
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-struct Status {
-	struct Error {
-		bool noMedia : 1;
-		bool endOfMedia : 1;
-		bool cutterJam : 1;
-		bool weakBatteries : 1;
-		bool printerInUse : 1;
-		bool notUsed1 : 1;
-		bool highVoltageAdapter : 1;
-		bool notUsed2 : 1;
-		bool replaceMedia : 1;
-		bool expansionBuffer : 1;
-		bool communication : 1;
-		bool communicationBufferFull : 1;
-		bool coverOpen : 1;
-		bool overheating : 1;
-		bool blackMarkingNotDetected : 1;
-		bool systemError : 1;
-	};
-
-	enum class ExtendedError : uint8_t {
-		FleTapeEnd = 0x10,
-		HighResolutionOrDraftPrintingError = 0x1d,
-		AdapterPullOrInsertError = 0x1e,
-		IncompatibleMediaError = 0x21,
-	};
+#include "ArgParser.hpp"
+#include "device.hpp"
+#include "status.hpp"
+#include "status_shm.hpp"
 
-	enum class StatusType : uint8_t {
-		ReplyToStatusRequest = 0x00,
-		PrintingCompleted = 0x01,
-		ErrorOccurred = 0x02,
-		ExitIFMode = 0x03,
-		TurnedOff = 0x04,
-		Notification = 0x05,
-		PhaseChange = 0x06,
-	};
 
-	enum class NotificationNumber : uint8_t {
-		NotAvailable = 0x00,
-		CoverOpen = 0x01,
-		CoverClosed = 0x02,
-		CoolingStarted = 0x03,
-		CoolingFinished = 0x04,
-	};
+static volatile std::sig_atomic_t stopRequested = 0;
 
-	enum class TapeColourInformation : uint8_t {
-		White = 0x01,
-		Other = 0x02,
-		Clear = 0x03,
-		Red = 0x04,
-		Blue = 0x05,
-		Yellow = 0x06,
-		Green = 0x07,
-		Black = 0x08,
-		ClearWhiteText = 0x09,
-		MatteWhite = 0x20,
-		MatteClear = 0x21,
-		MatteSilver = 0x22,
-		SatinGold = 0x23,
-		SatinSilver = 0x24,
-		BlueD = 0x30,
-		RedD = 0x31,
-		FluorescentOrange = 0x40,
-		FluorescentYellow = 0x41,
-		BerryPinkS = 0x50,
-		LightGrayS = 0x51,
-		YellowF = 0x60,
-		PinkF = 0x61,
-		BlueF = 0x62,
-		WhiteHSTube = 0x70,
-		WhiteFlexID = 0x90,
-		YellowFlexID = 0x91,
-		Cleaning = 0xf0,
-		Stencil = 0xf1,
-		Incompatible = 0xff,
-	};
+void check(uint8_t received, uint8_t expected, std::string_view label)
+{
+	if (received != expected) {
+		std::cerr
+			<< label << ": "
+			<< std::hex << std::setfill('0') << std::setw(2)
+			<< "received: " << static_cast<uint32_t>(received) << ", expected: " << static_cast<uint32_t>(expected) << "\n";
+	}
+}
 
-	enum class TextColourInformation : uint8_t {
-		White = 0x01,
-		Other = 0x02,
-		Red = 0x04,
-		Blue = 0x05,
-		Black = 0x08,
-		Gold = 0x0a,
-		BlueF = 0x62,
-		Cleaning = 0xf0,
-		Stencil = 0xf1,
-		Incompatible = 0xff,
-	};
+void checkStatus(const Status &status)
+{
+	check(status.printHeadMark, 0x80, "print head mark");
+	check(status.size, 0x20, "size");
+	check(status.brotherCode, 0x42, "brother code");
+	check(status.seriesCode, 0x30, "series code");
+	check(status.countryCode, 0x30, "country code");
+	check(status.numberOfColours, 0x00, "number of colours");
+	check(status.fonts, 0x00, "fonts");
+	check(status.japaneseFonts, 0x00, "japanese fonts");
+	check(status.density, 0x00, "density");
 
-	enum class BatteryLevel : uint8_t {
-		Full = 0x00,
-		Half = 0x01,
-		Low = 0x02,
-		NeedToBeCharged = 0x03,
-		UsingAcAdapter = 0x04,
-		Unknown = 0xff,
-	};
+	if (status.mediaWidth != 0x15)
+		check(status.mediaLength, 0x00, "media length");
+	else
+		check(status.mediaLength, 0x2d, "media length");
 
-	uint8_t printHeadMark;
-	uint8_t size;
-	uint8_t brotherCode, seriesCode, modelCode, countryCode;
-	BatteryLevel batteryLevel;
-	ExtendedError extendedError;
-	Error error;
-	uint8_t mediaWidth, mediaType;
-	uint8_t numberOfColours;
-	uint8_t fonts, japaneseFonts;
-	uint8_t mode;
-	uint8_t density;
-	uint8_t mediaLength;
-	StatusType statusType;
-	uint8_t phaseType, phaseNumber0, phaseNumber1;
-	NotificationNumber notificationNumber;
-	uint8_t expansionArea;
-	TapeColourInformation tapeColourInformation;
-	TextColourInformation textColourInformation;
-	uint8_t reserved[6];
+	check(status.expansionArea, 0x00, "expansion area");
+}
 
-	std::string_view modelCodeStr() const
-	{
-		switch (modelCode) {
-			case 0x71: return "PT-P900";
-			case 0x69: return "PT-P900W";
-			case 0x70: return "PT-P950NW";
-			case 0x78: return "PT-P910BT";
-			default: return "unrecognised";
-		}
+// prints every status frame arriving on the input, a device is followed until interrupted
+int follow(const std::string &inputFile, bool untilCompleted, StatusFormat format)
+{
+	int fd = ::open(inputFile.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		std::cerr << "Failed to open '" << inputFile << "': " << std::strerror(errno) << "\n";
+		return 1;
 	}
-
-	std::string errorStr() const
-	{
-		bool fleTapeEnd = extendedError == ExtendedError::FleTapeEnd;
-		bool highResolutionOrDraftPrintingError = extendedError == ExtendedError::HighResolutionOrDraftPrintingError;
-		bool adapterPullOrInsertError = extendedError == ExtendedError::AdapterPullOrInsertError;
-		bool incompatibleMediaError = extendedError == ExtendedError::IncompatibleMediaError;
-
-		bool first = true;
-		std::string errMsg;
-		for (const auto &[err, msg] : std::initializer_list<std::pair<bool, std::string_view> >{
-			{error.noMedia, "no media"},
-			{error.endOfMedia, "end of media"},
-			{error.cutterJam, "cutter jam"},
-			{error.weakBatteries, "weak batteries"},
-			{error.printerInUse, "printer in use"},
-			{error.highVoltageAdapter, "high voltage adapter"},
-			{error.replaceMedia, "replace media"},
-			{error.expansionBuffer, "expansion buffer"},
-			{error.communication, "communication"},
-			{error.communicationBufferFull, "communication buffer full"},
-			{error.coverOpen, "cover open"},
-			{error.overheating, "overheating"},
-			{error.blackMarkingNotDetected, "black marking not detected"},
-			{error.systemError, "system error"},
-			{fleTapeEnd, "Fle tape end"},
-			{highResolutionOrDraftPrintingError, "High-resolution/draft printing error"},
-			{adapterPullOrInsertError, "Adapter pull/insert error"},
-			{incompatibleMediaError, "Incompatible media error"},
-		}) {
-			if (err) {
-				if (!first)
-					errMsg += ", ";
-				errMsg += msg;
-				first = false;
-			}
+	struct stat st;
+	bool regular = ::fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+
+	int result = -1;
+	StatusFramer framer;
+	framer.subscribe([&](const Status &status) {
+		writeStatus(std::cout, status, format);
+		if (format == StatusFormat::Text)
+			std::cout << "\n";
+		std::cout.flush();
+		if (untilCompleted) {
+			if (status.statusType == Status::StatusType::PrintingCompleted)
+				result = 0;
+			else if (status.statusType == Status::StatusType::ErrorOccurred)
+				result = 1;
 		}
-
-		return errMsg;
-	}
-
-	std::string_view mediaWidthStr() const
-	{
-		switch (mediaWidth) {
-			case 0x00: return "no tape";
-			case 0x04: return "3.5 mm";
-			case 0x06: return "6 mm / HS 5.8 mm";
-			case 0x09: return "9 mm / HS 8.8 mm";
-			case 0x0c: return "12 mm / HS 11.7 mm";
-			case 0x12: return "18 mm / HS 17.7 mm";
-			case 0x18: return "24 mm / HS 23.6 mm";
-			case 0x24: return "36 mm";
-			case 0x15: return "FLe 21 mm x 45 mm";
-			default: return "unrecognised tape width: " + std::to_string(static_cast<unsigned>(mediaWidth));
+	});
+
+	std::signal(SIGINT, [](int) { stopRequested = 1; });
+	std::signal(SIGTERM, [](int) { stopRequested = 1; });
+
+	while (result < 0 && !stopRequested) {
+		if (regular) {
+			uint8_t buf[512];
+			ssize_t n = ::read(fd, buf, sizeof buf);
+			if (n <= 0)
+				break;
+			framer.feed(buf, n);
+		} else if (!pumpStatus(fd, framer, std::chrono::steady_clock::now() + std::chrono::seconds{1}) && errno != ETIMEDOUT) {
+			std::cerr << "Failed to read '" << inputFile << "': " << std::strerror(errno) << "\n";
+			::close(fd);
+			return 1;
 		}
 	}
+	::close(fd);
 
-	std::string mediaTypeStr() const
-	{
-		switch (mediaType) {
-			case 0x00: return "no media";
-			case 0x01: return "laminated tape";
-			case 0x03: return "non-laminated tape";
-			case 0x04: return "fabric tape";
-			case 0x11: return "heat-shrink tube";
-			case 0x13: return "Fle tape";
-			case 0x14: return "Flexible ID table";
-			case 0x15: return "Satin tape";
-			case 0x17: return "Heat-Shrink Tube (HS 3:1)";
-			case 0xff: return "incompatible tape";
-			default: return "unrecognised tape type: " + std::to_string(static_cast<unsigned>(mediaType));
-		}
-	}
+	if (framer.discarded())
+		std::cerr << "skipped " << framer.discarded() << " bytes outside of status frames\n";
 
-	std::string_view statusStr() const
-	{
-		switch (statusType) {
-			case StatusType::ReplyToStatusRequest: return "reply to status request";
-			case StatusType::PrintingCompleted: return "printing completed";
-			case StatusType::ErrorOccurred: return "error occurred";
-			case StatusType::TurnedOff: return "turned off";
-			case StatusType::Notification: return "notification";
-			case StatusType::PhaseChange: return "phase changed";
-			default:
-				if (static_cast<uint8_t>(statusType) < 0x21)
-					return "(not used)";
-				return "(reserved)";
-		}
-	}
+	if (untilCompleted)
+		return result == 0 ? 0 : 1;
+	return 0;
+}
 
-	std::string_view phaseStr() const
-	{
-		if (phaseType == 0x00) {
-			switch (phaseNumber1) {
-				case 0x00: return "editing state";
-				case 0x01: return "feed";
-				default: return "unrecognised editing state";
-			}
-		} else if (phaseType == 0x01) {
-			switch (phaseNumber1) {
-				case 0x00: return "printing";
-				case 0x0a: return "(not used)";
-				case 0x14: return "cover open while receiving";
-				case 0x19: return "(not used)";
-				default: return "unrecognised printing state";
-			}
-		}
-		return "unrecognised phase type";
+// discards everything pending on the input without blocking
+int drain(const std::string &inputFile)
+{
+	int fd = ::open(inputFile.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0) {
+		std::cerr << "Failed to open '" << inputFile << "': " << std::strerror(errno) << "\n";
+		return 1;
 	}
 
-	std::string_view notificationStr() const
-	{
-		switch (notificationNumber) {
-			case NotificationNumber::NotAvailable: return "not available";
-			case NotificationNumber::CoverOpen: return "cover open";
-			case NotificationNumber::CoverClosed: return "cover closed";
-			case NotificationNumber::CoolingStarted: return "cooling (started)";
-			case NotificationNumber::CoolingFinished: return "cooling (finished)";
-			default: return "unrecognised";
-		}
+	int64_t drained = bp::drainInput(fd);
+	if (drained < 0) {
+		std::cerr << "Failed to read '" << inputFile << "': " << std::strerror(errno) << "\n";
+		::close(fd);
+		return 1;
 	}
+	::close(fd);
 
-	std::string tapeColourStr() const
-	{
-		switch (tapeColourInformation) {
-			case TapeColourInformation::White: return "white";
-			case TapeColourInformation::Other: return "other";
-			case TapeColourInformation::Clear: return "clear";
-			case TapeColourInformation::Red: return "red";
-			case TapeColourInformation::Blue: return "blue";
-			case TapeColourInformation::Yellow: return "yellow";
-			case TapeColourInformation::Green: return "green";
-			case TapeColourInformation::Black: return "black";
-			case TapeColourInformation::ClearWhiteText: return "clear white text";
-			case TapeColourInformation::MatteWhite: return "matte white";
-			case TapeColourInformation::MatteClear: return "matte clear";
-			case TapeColourInformation::MatteSilver: return "matte silver";
-			case TapeColourInformation::SatinGold: return "satin gold";
-			case TapeColourInformation::SatinSilver: return "satin silver";
-			case TapeColourInformation::BlueD: return "blue (D)";
-			case TapeColourInformation::RedD: return "red (D)";
-			case TapeColourInformation::FluorescentOrange: return "fluorescent orange";
-			case TapeColourInformation::FluorescentYellow: return "fluorescent yellow";
-			case TapeColourInformation::BerryPinkS: return "berry pink (S)";
-			case TapeColourInformation::LightGrayS: return "light gray (S)";
-			case TapeColourInformation::YellowF: return "yellow (F)";
-			case TapeColourInformation::PinkF: return "pink (F)";
-			case TapeColourInformation::BlueF: return "blue (F)";
-			case TapeColourInformation::WhiteHSTube: return "white (Heat-shrink Tube)";
-			case TapeColourInformation::WhiteFlexID: return "white (Flex. ID)";
-			case TapeColourInformation::YellowFlexID: return "yellow (Flex. ID)";
-			case TapeColourInformation::Cleaning: return "cleaning";
-			case TapeColourInformation::Stencil: return "stencil";
-			case TapeColourInformation::Incompatible: return "incompatible";
-			default: return "unrecognised: " + std::to_string(static_cast<unsigned>(tapeColourInformation));
-		}
-	}
+	std::cout << "drained: " << drained << "\n";
+	return 0;
+}
 
-	std::string textColourStr() const
-	{
-		switch (textColourInformation) {
-			case TextColourInformation::White: return "white";
-			case TextColourInformation::Other: return "other";
-			case TextColourInformation::Red: return "red";
-			case TextColourInformation::Blue: return "blue";
-			case TextColourInformation::Black: return "black";
-			case TextColourInformation::Gold: return "gold";
-			case TextColourInformation::BlueF: return "blue (F)";
-			case TextColourInformation::Cleaning: return "cleaning";
-			case TextColourInformation::Stencil: return "stencil";
-			case TextColourInformation::Incompatible: return "incompatible";
-			default: return "unrecognised: " + std::to_string(static_cast<unsigned>(textColourInformation));
-		}
+// reads the latest status published by status_daemon --shm, older than maxAgeMs counts as missing
+int readShared(const std::string &name, int64_t maxAgeMs, StatusFormat format)
+{
+	bp::SharedStatusReader reader;
+	if (!reader.open(name)) {
+		std::cerr << "Failed to open shared memory '" << name << "': " << std::strerror(errno) << "\n";
+		return 1;
 	}
 
-	std::string_view batteryLevelStr() const
-	{
-		switch (batteryLevel) {
-			case BatteryLevel::Full: return "full";
-			case BatteryLevel::Half: return "half";
-			case BatteryLevel::Low: return "low";
-			case BatteryLevel::NeedToBeCharged: return "needs to be charged";
-			case BatteryLevel::UsingAcAdapter: return "using AC adapter";
-			case BatteryLevel::Unknown: return "unknown";
-			default: return "unrecognised";
-		}
+	bp::StatusSnapshot snapshot;
+	if (!reader.read(snapshot)) {
+		std::cerr << "No status in '" << name << "': " << std::strerror(errno) << "\n";
+		return 1;
 	}
-};
 
-void check(uint8_t received, uint8_t expected, std::string_view label)
-{
-	if (received != expected) {
-		std::cerr
-			<< label << ": "
-			<< std::hex << std::setfill('0') << std::setw(2)
-			<< "received: " << static_cast<uint32_t>(received) << ", expected: " << static_cast<uint32_t>(expected) << "\n";
+	int64_t ageMs = (bp::steadyNowNs() - snapshot.timestampNs) / 1000000;
+	if (maxAgeMs >= 0 && ageMs > maxAgeMs) {
+		std::cerr << "Stale status in '" << name << "': " << ageMs << " ms old\n";
+		return 1;
 	}
+
+	writeStatus(std::cout, snapshot.status, format);
+	return 0;
 }
 
-void printHex(uint8_t e, std::string_view label)
+// prints the latency histograms the status owner keeps next to the status
+int readLatencies(const std::string &name, StatusFormat format)
 {
-	std::cout << label << ": " << std::hex << static_cast<uint32_t>(e) << "\n";
+	bp::SharedStatusReader reader;
+	if (!reader.open(name)) {
+		std::cerr << "Failed to open shared memory '" << name << "': " << std::strerror(errno) << "\n";
+		return 1;
+	}
+
+	reader.latencies().forEach([format](std::string_view name, const bp::LatencyHistogram &histogram) {
+		if (format == StatusFormat::Json)
+			bp::printHistogramJson(std::cout, name, histogram);
+		else
+			bp::printHistogram(std::cout, name, histogram);
+	});
+	return 0;
 }
 
 int main(int argc, char **argv)
 {
 	ArgParser parser;
 	parser.addPositionalArgument(Arg{"input"});
+	parser.addArgument(Arg{"--follow"}.setOptional().setCount(0));
+	parser.addArgument(Arg{"--until-completed"}.setOptional().setCount(0));
+	parser.addArgument(Arg{"--drain"}.setOptional().setCount(0));
+	parser.addArgument(Arg{"--format"}.setOptional());
+	parser.addArgument(Arg{"--shm"}.setOptional().setCount(0));
+	parser.addArgument(Arg{"--max-age"}.setOptional());
+	parser.addArgument(Arg{"--latencies"}.setOptional().setCount(0));
 
 	parser.parse(argc - 1, argv + 1);
 	if (!parser.isValid()) {
@@ -351,8 +182,22 @@ int main(int argc, char **argv)
 		return 1;
 	}
 
+	StatusFormat format = StatusFormat::Text;
+	if (parser.has("--format") && !parseStatusFormat(parser.value("--format"), format)) {
+		std::cerr << "Invalid format: " << parser.value("--format") << "\n";
+		return 1;
+	}
+
+	if (parser.has("--shm") && parser.has("--latencies"))
+		return readLatencies(parser.value("input"), format);
+	if (parser.has("--shm"))
+		return readShared(parser.value("input"), parser.has("--max-age") ? std::stoi(parser.value("--max-age")) : -1, format);
+	if (parser.has("--drain"))
+		return drain(parser.value("input"));
+	if (parser.has("--follow") || parser.has("--until-completed"))
+		return follow(parser.value("input"), parser.has("--until-completed"), format);
+
 	Status status;
-	assert(sizeof(status) == 32u);
 	{
 		const std::string &inputFile = parser.value("input");
 		std::ifstream is{inputFile, std::ios::binary | std::ios::in};
@@ -372,39 +217,8 @@ int main(int argc, char **argv)
 		}
 	}
 
-	check(status.printHeadMark, 0x80, "print head mark");
-	check(status.size, 0x20, "size");
-	check(status.brotherCode, 0x42, "brother code");
-	check(status.seriesCode, 0x30, "series code");
-	std::cout << "model code: " << status.modelCodeStr() << "\n";
-	check(status.countryCode, 0x30, "country code");
-
-	std::cout << "battery level: " << status.batteryLevelStr() << "\n";
-	std::cout << "error information: " << status.errorStr() << "\n";
-	std::cout << "media width: " << status.mediaWidthStr() << "\n";
-	std::cout << "media type: " << status.mediaTypeStr() << "\n";
-
-	check(status.numberOfColours, 0x00, "number of colours");
-	check(status.fonts, 0x00, "fonts");
-	check(status.japaneseFonts, 0x00, "japanese fonts");
-
-	printHex(status.mode, "mode");
-
-	check(status.density, 0x00, "density");
-
-	if (status.mediaWidth != 0x15)
-		check(status.mediaLength, 0x00, "media length");
-	else
-		check(status.mediaLength, 0x2d, "media length");
-
-	std::cout << "status: " << status.statusStr() << "\n";
-	std::cout << "phase: " << status.phaseStr() << "\n";
-	std::cout << "notification: " << status.notificationStr() << "\n";
-
-	check(status.expansionArea, 0x00, "expansion area");
-
-	std::cout << "tape colour: " << status.tapeColourStr() << "\n";
-	std::cout << "text colour: " << status.textColourStr() << "\n";
+	checkStatus(status);
+	writeStatus(std::cout, status, format);
 
 	return 0;
 }
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "device.hpp"
+#include "raster.hpp"
+#include "sha256.hpp"
+
+
+namespace bp {
+
+// Keeps finished print requests in a directory, each named after the hash of the image file and of every setting that
+// goes into the request, so reprinting a label skips decoding, scaling and rasterizing. Once the directory grows past
+// its size limit the least recently used requests are removed (by modification time, which a hit renews). Any number
+// of processes and threads can share a directory: requests are written to a temporary file and renamed into place.
+class RenderCache {
+public:
+	static constexpr unsigned Version = 1;  // part of every key, to be bumped when the rendering changes
+	static constexpr uint64_t DefaultMaxBytes = uint64_t{256} << 20;
+
+	struct Counters {
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		uint64_t evictions = 0;
+	};
+
+	explicit RenderCache(std::string dir, uint64_t maxBytes = DefaultMaxBytes) : m_dir(std::move(dir)), m_maxBytes(maxBytes)
+	{
+	}
+
+	// every setting that changes the request, but not the image
+	static std::string settingsKey(const JobSettings &settings)
+	{
+		return std::format("ptouch request {}\n{}\n{}\n{}\n{}\n{}{}{}{}{}{}{}\n", Version, settings.tapeWidth, settings.copies,
+			settings.lengthMargin, settings.compressed, settings.autoCut, settings.halfCut, settings.chainPrinting,
+			settings.mirrorPrinting, settings.scaleDown, settings.scaleUp, settings.center);
+	}
+
+	// empty if the image can't be read, the job is rendered as usual then; the image file's bytes are left in image, to
+	// be decoded from there (see imageStream), so that a file replaced meanwhile can't be stored under the old one's key
+	std::string key(const JobSettings &settings, std::string &image) const
+	{
+		Sha256 hash;
+		hash.update(settingsKey(settings));
+
+		image.clear();
+		if (settings.image == "test") {
+			hash.update("test page");
+		} else {
+			int fd = ::open(settings.image.c_str(), O_RDONLY | O_CLOEXEC);
+			if (fd < 0)
+				return {};
+			char buf[1 << 16];
+			ssize_t n;
+			while ((n = ::read(fd, buf, sizeof buf)) > 0)
+				image.append(buf, n);
+			::close(fd);
+			if (n < 0)
+				return {};
+			hash.update(image);
+		}
+
+		return hash.hexDigest();
+	}
+
+	// what loadImage is to decode for a key from key(): the bytes that were hashed, or the file itself (or the test page)
+	// without a key
+	static std::istream * imageStream(const JobSettings &settings, const std::string &key, std::istringstream &image)
+	{
+		return key.empty() || settings.image == "test" ? nullptr : &image;
+	}
+
+	// the cached request, false on a miss
+	bool get(const std::string &key, std::string &request)
+	{
+		auto path = pathOf(key);
+		std::ifstream in{path, std::ios::binary};
+		if (!in) {
+			++m_misses;
+			return false;
+		}
+		std::ostringstream data;
+		data << in.rdbuf();
+		request = std::move(data).str();
+		if (!in || request.empty()) {
+			++m_misses;
+			return false;
+		}
+
+		::utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+		++m_hits;
+		return true;
+	}
+
+	// error message if the request couldn't be stored, which doesn't affect the job
+	std::string put(const std::string &key, std::string_view request)
+	{
+		if (::mkdir(m_dir.c_str(), 0755) < 0 && errno != EEXIST)
+			return std::format("failed to create '{}': {}", m_dir, std::strerror(errno));
+
+		auto tmpPath = std::format("{}/.{}.XXXXXX", m_dir, key);
+		int fd = ::mkstemp(tmpPath.data());
+		if (fd < 0)
+			return std::format("failed to create '{}': {}", tmpPath, std::strerror(errno));
+		bool ok = writeAll(fd, request.data(), request.size());
+		ok = ::close(fd) == 0 && ok;
+		if (!ok || ::rename(tmpPath.c_str(), pathOf(key).c_str()) < 0) {
+			auto error = std::format("failed to write '{}': {}", pathOf(key), std::strerror(errno));
+			::unlink(tmpPath.c_str());
+			return error;
+		}
+
+		evict();
+		return {};
+	}
+
+	Counters counters() const
+	{
+		return Counters{m_hits.load(), m_misses.load(), m_evictions.load()};
+	}
+
+private:
+	std::string pathOf(const std::string &key) const
+	{
+		return std::format("{}/{}.prn", m_dir, key);
+	}
+
+	// the whole directory is looked at after every store, fine for the thousands of requests it holds at most
+	void evict()
+	{
+		struct Entry {
+			std::string path;
+			uint64_t size;
+			struct timespec mtime;
+		};
+		std::vector<Entry> entries;
+		uint64_t total = 0;
+
+		DIR *dir = ::opendir(m_dir.c_str());
+		if (!dir)
+			return;
+		while (auto entry = ::readdir(dir)) {
+			std::string_view name = entry->d_name;
+			if (name.starts_with('.') || !name.ends_with(".prn"))
+				continue;
+			auto path = std::format("{}/{}", m_dir, name);
+			struct stat st;
+			if (::stat(path.c_str(), &st) < 0)
+				continue;
+			entries.push_back(Entry{std::move(path), static_cast<uint64_t>(st.st_size), st.st_mtim});
+			total += st.st_size;
+		}
+		::closedir(dir);
+		if (total <= m_maxBytes)
+			return;
+
+		std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+			return a.mtime.tv_sec != b.mtime.tv_sec ? a.mtime.tv_sec < b.mtime.tv_sec : a.mtime.tv_nsec < b.mtime.tv_nsec;
+		});
+		for (const auto &entry : entries) {
+			if (total <= m_maxBytes)
+				break;
+			// another process may have removed it already
+			if (::unlink(entry.path.c_str()) == 0)
+				++m_evictions;
+			total -= entry.size;
+		}
+	}
+
+	std::string m_dir;
+	uint64_t m_maxBytes;
+	std::atomic<uint64_t> m_hits = 0;
+	std::atomic<uint64_t> m_misses = 0;
+	std::atomic<uint64_t> m_evictions = 0;
+};
+
+}
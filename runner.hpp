@@ -0,0 +1,681 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <format>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "commands.hpp"
+#include "payload_cache.hpp"
+#include "raster.hpp"
+#include "render_cache.hpp"
+#include "sender.hpp"
+#include "spool.hpp"
+#include "status.hpp"
+#include "thermal.hpp"
+#include "worker_pool.hpp"
+
+
+// Prints a list of jobs with rendering and printing overlapped: while job N is printing, the next ones are rasterized
+// into memory (on as many threads as asked for), and job N+1 goes out as soon as a printer reports its previous job as
+// completed.
+
+namespace bp {
+
+// the media checks manage.py's verify_args did, error message if the printer doesn't hold what the job needs; an empty
+// tape type or colour in the job matches any
+inline std::string checkMedia(const Status &status, const JobSettings &settings)
+{
+	auto width = status.mediaWidthStr();
+	bool widthMatches = false;
+	for (size_t pos = 0; pos <= width.size() && !widthMatches;) {
+		size_t end = std::min(width.find(" / ", pos), width.size());
+		widthMatches = width.compare(pos, end - pos, settings.tapeWidth) == 0;
+		pos = end + 3;
+	}
+	if (!widthMatches)
+		return std::format("Mismatched tape width: {}, expected {}", settings.tapeWidth, width);
+	if (!settings.tapeType.empty() && settings.tapeType != status.mediaTypeStr())
+		return std::format("Mismatched tape type: {}, expected {}", settings.tapeType, status.mediaTypeStr());
+	if (!settings.tapeColour.empty() && settings.tapeColour != status.tapeColourStr())
+		return std::format("Mismatched tape colour: {}, expected {}", settings.tapeColour, status.tapeColourStr());
+	if (!settings.textColour.empty() && settings.textColour != status.textColourStr())
+		return std::format("Mismatched text colour: {}, expected {}", settings.textColour, status.textColourStr());
+	return {};
+}
+
+struct RenderedJob {
+	size_t index = 0;
+	std::string name;
+	JobSettings settings;  // for picking a printer
+	PayloadCache::Payload data;  // the complete print request, possibly shared with the memory cache
+	unsigned pages = 0;
+	uint64_t rasterLines = 0;  // all pages
+	std::string error;
+	std::chrono::steady_clock::duration renderTime{};
+	bool cached = false;  // taken from the render cache
+	unsigned failures = 0;  // printers it failed on
+};
+
+// names an image by its path and the identity of the file, so that looking up a label printed before costs a stat()
+// instead of reading the image, empty if there is no such file
+inline std::string payloadKey(const JobSettings &settings)
+{
+	std::string key = RenderCache::settingsKey(settings) + settings.image;
+	if (settings.image == "test")
+		return key;
+	struct stat st;
+	if (::stat(settings.image.c_str(), &st) < 0)
+		return {};
+	return key + std::format("\n{}:{}:{}:{}.{}", st.st_dev, st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+}
+
+// the request for an image loaded already, false with job.error set if it can't be made
+template <class Image>
+bool renderImage(RenderedJob &job, const JobSettings &settings, const Image &image, unsigned imageWidth, uint8_t flags)
+{
+	std::ostringstream out;
+	if (auto exec = writePrintRequest(out, settings, image, imageWidth, flags); !exec) {
+		job.error = exec.error;
+		return false;
+	}
+	job.data = std::make_shared<const std::string>(std::move(out).str());
+	job.rasterLines = uint64_t{4} * imageWidth * settings.copies;
+	return true;
+}
+
+// with caches, a request rendered before for the same image and settings is used as it is: from memory, or else from
+// the disk (and then kept in memory too)
+inline RenderedJob renderJob(const JobSettings &settings, size_t index, RenderCache *cache = nullptr, PayloadCache *memory = nullptr)
+{
+	RenderedJob job;
+	job.index = index;
+	job.name = settings.image;
+	job.settings = settings;
+	job.pages = settings.copies;
+
+	auto start = std::chrono::steady_clock::now();
+	auto found = [&](PayloadCache::Payload payload) {
+		SpoolIndex pages;
+		if (!scanSpool(reinterpret_cast<const uint8_t *>(payload->data()), payload->size(), 0, pages).empty())
+			return false;
+		for (const auto &page : pages.pages)
+			job.rasterLines += page.rasterCount;
+		job.data = std::move(payload);
+		job.cached = true;
+		job.renderTime = std::chrono::steady_clock::now() - start;
+		return true;
+	};
+
+	std::string memoryKey = memory ? payloadKey(settings) : std::string{};
+	if (!memoryKey.empty()) {
+		if (auto payload = memory->get(memoryKey); payload && found(std::move(payload)))
+			return job;
+	}
+	std::string imageData;
+	std::string key = cache ? cache->key(settings, imageData) : std::string{};
+	if (std::string data; !key.empty() && cache->get(key, data)) {
+		auto payload = std::make_shared<const std::string>(std::move(data));
+		if (found(payload)) {
+			if (!memoryKey.empty())
+				memory->put(memoryKey, std::move(payload));
+			return job;
+		}
+	}
+
+	uint8_t flags;
+	png::image<png::rgb_pixel> image;
+	unsigned imageWidth;
+	std::istringstream imageIn{std::move(imageData)};
+	if (auto exec = loadImage(settings, image, imageWidth, flags, RenderCache::imageStream(settings, key, imageIn)); !exec) {
+		job.error = exec.error;
+		return job;
+	}
+
+	if (!renderImage(job, settings, image, imageWidth, flags))
+		return job;
+	auto payload = job.data;
+	if (!key.empty()) {
+		if (auto error = cache->put(key, *payload); !error.empty())
+			std::cerr << "Render cache: " << error << "\n";
+	}
+	if (!memoryKey.empty())
+		memory->put(memoryKey, std::move(payload));
+	job.renderTime = std::chrono::steady_clock::now() - start;
+
+	return job;
+}
+
+// one printer: sends a job and waits until all its pages are reported as completed, keeps track of the head temperature
+// and of the latest status it reported (media, phase, errors)
+class JobRunner {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	struct Timing {
+		Clock::duration render{};
+		Clock::duration send{};
+		Clock::duration print{};  // last byte written until the last page completed
+		Clock::duration gap{};  // previous job completed until this one started going out
+	};
+
+	JobRunner(std::string path, int device, std::chrono::milliseconds jobTimeout, std::chrono::milliseconds resumeTimeout, ThermalModel thermal = ThermalModel{})
+		: m_path(std::move(path)), m_device(device), m_jobTimeout(jobTimeout), m_sender(device, resumeTimeout), m_thermal(thermal)
+	{
+		m_sender.subscribe([this](const Status &status) {
+			{
+				std::lock_guard lock{m_sharedMutex};
+				m_status = status;
+				if (status.notificationNumber == Status::NotificationNumber::CoolingStarted)
+					m_thermal.coolingStarted(Clock::now());
+				else if (status.notificationNumber == Status::NotificationNumber::CoolingFinished)
+					m_thermal.coolingFinished(Clock::now());
+			}
+			if (status.statusType == Status::StatusType::PrintingCompleted)
+				++m_completed;
+			else if (MonitoredSender::isFatal(status))
+				m_error = status.errorStr();
+			if (status.statusType == Status::StatusType::ReplyToStatusRequest)
+				m_reply = status;
+		});
+	}
+
+	const std::string & path() const
+	{
+		return m_path;
+	}
+
+	// a copy, the printer's thread keeps updating the model (safe to call from any thread)
+	ThermalModel thermal() const
+	{
+		std::lock_guard lock{m_sharedMutex};
+		return m_thermal;
+	}
+
+	// from the last frame read, nullopt before the first; every frame carries the media, so a tape swapped meanwhile
+	// shows once the printer reports anything, the status requests in idle() included (safe to call from any thread)
+	std::optional<Status> status() const
+	{
+		std::lock_guard lock{m_sharedMutex};
+		return m_status;
+	}
+
+	// the reply to a status request, nullopt on timeout or error (errno)
+	std::optional<Status> requestStatus(std::chrono::milliseconds timeout)
+	{
+		m_reply.reset();
+		m_lastRequest = Clock::now();
+		if (!writeStruct(m_device, StatusRequest{}))
+			return std::nullopt;
+		auto deadline = m_lastRequest + timeout;
+		while (!m_reply && Clock::now() < deadline) {
+			if (!m_sender.receive(deadline))
+				return std::nullopt;
+		}
+		if (!m_reply)
+			errno = ETIMEDOUT;
+		return m_reply;
+	}
+
+	// the printer has to be idle and without errors, an error reported earlier is forgotten once it is
+	std::string checkReady(std::chrono::milliseconds timeout)
+	{
+		auto status = requestStatus(timeout);
+		if (!status)
+			return errno == ETIMEDOUT ? "no status reply" : std::format("failed to read status: {}", std::strerror(errno));
+		if (!status->errors().empty())
+			return std::format("printer reported '{}'", status->errorStr());
+		if (!status->isReady())
+			return std::format("printer is not ready: {}", status->phaseStr());
+		m_error.clear();
+		return {};
+	}
+
+	// between jobs: picks up what the printer reports (such as the end of cooling), asking for it every second
+	std::string idle(Clock::time_point until)
+	{
+		auto now = Clock::now();
+		if (now - m_lastRequest >= std::chrono::seconds{1}) {
+			m_lastRequest = now;
+			if (!writeStruct(m_device, StatusRequest{}))
+				return std::format("failed to request status: {}", std::strerror(errno));
+		}
+		if (!m_sender.receive(until))
+			return std::format("failed to read status: {}", std::strerror(errno));
+		if (!m_error.empty())
+			return std::format("printer reported '{}'", m_error);
+		return {};
+	}
+
+	std::string print(const RenderedJob &job, Timing &timing)
+	{
+		timing.render = job.renderTime;
+		auto start = Clock::now();
+		timing.gap = start - m_lastCompleted;
+
+		unsigned completedBefore = m_completed;
+		{
+			std::lock_guard lock{m_sharedMutex};
+			m_thermal.addLines(job.rasterLines, start);
+		}
+		auto data = reinterpret_cast<const uint8_t *>(job.data->data());
+		if (auto error = m_sender.send(data, job.data->size()); !error.empty())
+			return error;
+		auto sent = Clock::now();
+		timing.send = sent - start;
+
+		auto deadline = sent + m_jobTimeout;
+		while (m_completed - completedBefore < job.pages && m_error.empty()) {
+			if (Clock::now() > deadline)
+				return std::format("not completed within {} ms", m_jobTimeout.count());
+			if (!m_sender.receive(deadline))
+				return std::format("failed to read status: {}", std::strerror(errno));
+		}
+		if (!m_error.empty())
+			return std::format("printer reported '{}'", m_error);
+
+		m_lastCompleted = Clock::now();
+		timing.print = m_lastCompleted - sent;
+		return {};
+	}
+
+private:
+	std::string m_path;
+	int m_device;
+	std::chrono::milliseconds m_jobTimeout;
+	MonitoredSender m_sender;
+	ThermalModel m_thermal;  // under m_sharedMutex
+	unsigned m_completed = 0;
+	std::string m_error;
+	std::optional<Status> m_reply;
+	mutable std::mutex m_sharedMutex;  // guards what other threads read: the thermal model and the status
+	std::optional<Status> m_status;
+	Clock::time_point m_lastCompleted = Clock::now();
+	Clock::time_point m_lastRequest{};
+};
+
+enum class JobEvent {
+	Rendering,
+	Sending,  // again when the job goes to another printer
+	Completed,
+	Failed,
+};
+
+// Spreads the jobs over the printers: a pool of threads renders ahead in order, one thread per printer prints, and the
+// dispatcher queues every job at a printer holding matching media, the one with the fewest jobs queued and of those the
+// one with the most thermal headroom. An idle printer that would run into its cooling limit makes the job wait for a
+// busy printer to have room (rerouting) or for a head to cool down (throttling), whichever comes first. A printer that
+// fails is taken out of service and its jobs go to the others; it is back once it reports being ready again.
+class JobScheduler {
+public:
+	using Clock = std::chrono::steady_clock;
+	using Renderer = std::function<RenderedJob(size_t index)>;
+	// called on the scheduler's threads with the index of a job in its run, so it has to be quick
+	using Listener = std::function<void(size_t index, JobEvent event, std::string_view error)>;
+
+	static constexpr size_t RenderAhead = 2;  // jobs rasterized while the printers are busy, at least
+	static constexpr size_t QueueDepth = 2;  // jobs per printer, the one printing included
+	static constexpr std::chrono::milliseconds StatusTimeout{500};  // for telling whether a printer is back
+
+	explicit JobScheduler(std::vector<JobRunner *> printers, size_t renderWorkers = 1, RenderCache *cache = nullptr, PayloadCache *memory = nullptr)
+		: m_renderWorkers(std::max<size_t>(renderWorkers, 1)), m_cache(cache), m_memory(memory)
+	{
+		for (auto runner : printers)
+			m_workers.push_back(std::make_unique<Worker>(runner));
+	}
+
+	// with a listener, a job that can't be printed is reported to it and the run goes on
+	void setListener(Listener listener)
+	{
+		m_listener = std::move(listener);
+	}
+
+	// prints the jobs, the first error stops the run (a job failing on a printer isn't one, unless it fails on a second);
+	// can be called again for more jobs, the printers, their thermal models and which are out of service carry over
+	std::string run(const std::vector<JobSettings> &jobs, std::ostream &log)
+	{
+		return run(jobs.size(), [this, &jobs](size_t i) { return render(jobs[i], i); }, log);
+	}
+
+	// what run() makes of a job, with the scheduler's caches
+	RenderedJob render(const JobSettings &settings, size_t index) const
+	{
+		return renderJob(settings, index, m_cache, m_memory);
+	}
+
+	// the same for count jobs that render makes from their index, for images that aren't files
+	std::string run(size_t count, const Renderer &render, std::ostream &log)
+	{
+		m_log = &log;
+		m_stopping = false;
+		m_error.clear();
+		m_printed = 0;
+		m_failed = 0;
+		m_rerouted = 0;
+		m_totalGap = {};
+		m_gaps = 0;
+		m_heldBack = {};
+		for (auto &worker : m_workers) {
+			worker->printed = 0;
+			worker->thread = std::thread([this, w = worker.get()] { work(*w); });
+		}
+
+		auto runStart = Clock::now();
+		std::optional<OrderedWorkerPool<RenderedJob>::Counters> renderCounters;
+		{
+			OrderedWorkerPool<RenderedJob> renderers{count, [this, &render](size_t i) { notify(i, JobEvent::Rendering); return render(i); },
+				m_renderWorkers, std::max(RenderAhead, m_renderWorkers)};
+			while (auto rendered = renderers.next()) {
+				if (!rendered->error.empty()) {
+					std::lock_guard lock{m_mutex};
+					if (fail(*rendered, rendered->error))
+						continue;
+				}
+				if (!dispatch(std::move(*rendered)))
+					break;
+			}
+			renderCounters = renderers.counters();
+		}
+
+		{
+			std::unique_lock lock{m_mutex};
+			drain(lock, true);
+			// after an error the jobs being printed are finished, the queued ones dropped
+			m_cv.wait(lock, [this] { return std::none_of(m_workers.begin(), m_workers.end(), [](const auto &w) { return w->job || !w->queue.empty(); }); });
+			m_pending.clear();
+			m_stopping = true;
+		}
+		m_cv.notify_all();
+		for (auto &worker : m_workers)
+			worker->thread.join();
+
+		log << std::format("{} of {} jobs printed in {} ms", m_printed, count, toMs(Clock::now() - runStart));
+		if (m_failed)
+			log << std::format(", {} failed", m_failed);
+		if (m_gaps)
+			log << std::format(", mean gap between jobs {} ms", toMs(m_totalGap) / static_cast<int64_t>(m_gaps));
+		if (m_heldBack.count())
+			log << std::format(", held back for cooling {} ms", toMs(m_heldBack));
+		if (m_rerouted)
+			log << std::format(", {} rerouted", m_rerouted);
+		log << "\n";
+		log << std::format("{} render workers {:.0f}% busy, dispatcher waited {} ms for rendering\n",
+			renderCounters->workers.size(), 100 * renderCounters->utilisation(), toMs(renderCounters->consumerWait));
+		if (m_cache) {
+			auto counters = m_cache->counters();
+			log << std::format("render cache: {} hits, {} misses, {} evicted\n", counters.hits, counters.misses, counters.evictions);
+		}
+		if (m_memory) {
+			auto counters = m_memory->counters();
+			log << std::format("memory cache: {} hits, {} misses, {} evicted, {} requests in {} KiB\n",
+				counters.hits, counters.misses, counters.evictions, counters.entries, counters.bytes >> 10);
+		}
+		for (const auto &worker : m_workers) {
+			auto thermal = worker->runner->thermal();
+			log << std::format("{}: {} jobs", worker->runner->path(), worker->printed);
+			if (thermal.coolings())
+				log << std::format(", cooled down {} times, learned limit {:.0f} raster lines", thermal.coolings(), thermal.limit());
+			if (!worker->outOfService.empty())
+				log << std::format(", out of service: {}", worker->outOfService);
+			log << "\n";
+		}
+
+		return m_error;
+	}
+
+private:
+	struct Pending {
+		RenderedJob job;
+		Clock::time_point since;
+		bool heldBack = false;
+	};
+
+	struct Worker {
+		explicit Worker(JobRunner *runner) : runner(runner) {}
+
+		JobRunner *runner;
+		std::optional<RenderedJob> job;  // being printed
+		std::deque<RenderedJob> queue;  // to be printed next
+		std::string outOfService;  // why it takes no jobs, empty if it does
+		std::thread thread;
+		size_t printed = 0;
+	};
+
+	static int64_t toMs(Clock::duration d)
+	{
+		return std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
+	}
+
+	void notify(size_t index, JobEvent event, std::string_view error = {})
+	{
+		if (m_listener)
+			m_listener(index, event, error);
+	}
+
+	// under the lock: a job that can't be printed, false if that ends the run; the listener gets the error as it is, the
+	// run's error says which job (and printer) it was
+	bool fail(const RenderedJob &job, std::string_view error, std::string_view printer = {})
+	{
+		if (m_listener) {
+			m_listener(job.index, JobEvent::Failed, error);
+			++m_failed;
+			return true;
+		}
+		if (m_error.empty())
+			m_error = printer.empty() ? std::format("job {} ({}): {}", job.index, job.name, error) : std::format("job {} ({}) on {}: {}", job.index, job.name, printer, error);
+		return false;
+	}
+
+	// false once the run failed
+	bool dispatch(RenderedJob job)
+	{
+		std::unique_lock lock{m_mutex};
+		m_pending.push_back(Pending{std::move(job), Clock::now()});
+		return drain(lock, false);
+	}
+
+	// hands the pending jobs to printers as they have room, until fewer are left than there are printers, so that a job
+	// waiting for its tape doesn't hold up the ones for other printers (with all, until none is left and the printers
+	// are done too, since a failing one gives its jobs back), false once the run failed
+	bool drain(std::unique_lock<std::mutex> &lock, bool all)
+	{
+		for (;;) {
+			auto now = Clock::now();
+			auto wait = Clock::duration::max();
+			bool placed = false;
+			for (auto it = m_pending.begin(); it != m_pending.end() && m_error.empty();) {
+				auto delay = Clock::duration::max();
+				std::string unplaceable;
+				if (Worker *worker = pick(it->job, now, delay, unplaceable)) {
+					if (it->heldBack && now - it->since >= std::chrono::milliseconds{1}) {
+						m_heldBack += now - it->since;
+						*m_log << std::format("job {} ({}): held back {} ms for cooling\n", it->job.index, it->job.name, toMs(now - it->since));
+					}
+					worker->queue.push_back(std::move(it->job));
+					it = m_pending.erase(it);
+					placed = true;
+				} else if (!unplaceable.empty()) {
+					if (fail(it->job, unplaceable))
+						it = m_pending.erase(it);
+				} else {
+					it->heldBack = it->heldBack || delay != Clock::duration::max();
+					wait = std::min(wait, delay);
+					++it;
+				}
+			}
+			if (placed)
+				m_cv.notify_all();
+			if (!m_error.empty())
+				return false;
+
+			bool busy = std::any_of(m_workers.begin(), m_workers.end(), [](const auto &w) { return w->job || !w->queue.empty(); });
+			if (all ? m_pending.empty() && !busy : m_pending.size() < m_workers.size())
+				return true;
+			if (wait == Clock::duration::max())
+				m_cv.wait(lock);
+			else
+				m_cv.wait_for(lock, std::min(wait, Clock::duration{std::chrono::milliseconds{100}}));
+		}
+	}
+
+	// the printer for the job, nullptr if it has to wait: delay is then set if an idle printer only has to cool down,
+	// unplaceable if no printer in service holds matching media
+	Worker * pick(const RenderedJob &job, Clock::time_point now, Clock::duration &delay, std::string &unplaceable)
+	{
+		Worker *best = nullptr;
+		size_t bestLoad = 0;
+		bool matching = false;
+		std::string mismatches;
+		for (auto &worker : m_workers) {
+			auto status = worker->runner->status();
+			std::string mismatch = !worker->outOfService.empty() ? std::format("out of service ({})", worker->outOfService)
+				: status ? checkMedia(*status, job.settings) : "no status";
+			if (!mismatch.empty()) {
+				mismatches += std::format(", {}: {}", worker->runner->path(), mismatch);
+				continue;
+			}
+			matching = true;
+
+			auto thermal = worker->runner->thermal();
+			size_t load = worker->queue.size() + worker->job.has_value();
+			if (load >= QueueDepth || thermal.isCooling())
+				continue;
+			// the job being printed already counts, the queued ones not yet
+			uint64_t lines = job.rasterLines;
+			for (const auto &queued : worker->queue)
+				lines += queued.rasterLines;
+			if (auto wait = thermal.delayFor(lines, now); wait > Clock::duration::zero()) {
+				if (load == 0)
+					delay = std::min(delay, wait);
+				continue;
+			}
+			if (!best || load < bestLoad || (load == bestLoad && thermal.load(now) < best->runner->thermal().load(now))) {
+				best = worker.get();
+				bestLoad = load;
+			}
+		}
+
+		if (!matching)
+			unplaceable = std::format("no printer to take it{}", mismatches);
+		return best;
+	}
+
+	// under the lock: its queued jobs go back to the dispatcher, ahead of the others
+	void takeOutOfService(Worker &worker, std::string error)
+	{
+		*m_log << std::format("{}: out of service, {} queued jobs rerouted\n", worker.runner->path(), worker.queue.size());
+		worker.outOfService = std::move(error);
+		m_rerouted += worker.queue.size();
+		for (; !worker.queue.empty(); worker.queue.pop_back())
+			m_pending.push_front(Pending{std::move(worker.queue.back()), Clock::now()});
+	}
+
+	void work(Worker &worker)
+	{
+		std::unique_lock lock{m_mutex};
+		while (!m_stopping) {
+			if (!worker.job && !worker.queue.empty()) {
+				if (!m_error.empty()) {
+					worker.queue.clear();
+					m_cv.notify_all();
+					continue;
+				}
+				worker.job = std::move(worker.queue.front());
+				worker.queue.pop_front();
+			}
+
+			if (worker.job) {
+				const auto &job = *worker.job;
+				lock.unlock();
+				notify(job.index, JobEvent::Sending);
+				JobRunner::Timing timing;
+				auto error = worker.runner->print(job, timing);
+				lock.lock();
+
+				if (error.empty()) {
+					*m_log << std::format("job {} ({}) on {}: {} in {} ms, sent in {} ms, printed in {} ms, gap {} ms\n",
+						job.index, job.name, worker.runner->path(), job.cached ? "cached" : "rendered", toMs(timing.render),
+						toMs(timing.send), toMs(timing.print), toMs(timing.gap));
+					if (worker.printed++) {
+						m_totalGap += timing.gap;
+						++m_gaps;
+					}
+					++m_printed;
+					notify(job.index, JobEvent::Completed);
+				} else {
+					*m_log << std::format("job {} ({}) on {}: {}\n", job.index, job.name, worker.runner->path(), error);
+					// failing once is put down to the printer, failing again more likely to the job
+					if (worker.job->failures++) {
+						fail(job, error, worker.runner->path());
+					} else if (m_error.empty()) {
+						m_pending.push_front(Pending{std::move(*worker.job), Clock::now()});
+						++m_rerouted;
+					}
+					takeOutOfService(worker, error);
+				}
+				worker.job.reset();
+				m_cv.notify_all();
+			} else if (!worker.outOfService.empty()) {
+				m_cv.wait_for(lock, std::chrono::seconds{1}, [this] { return m_stopping; });
+				if (m_stopping)
+					break;
+				lock.unlock();
+				auto error = worker.runner->checkReady(StatusTimeout);
+				lock.lock();
+				if (error.empty()) {
+					*m_log << std::format("{}: back in service\n", worker.runner->path());
+					worker.outOfService.clear();
+					m_cv.notify_all();
+				}
+			} else {
+				// asking for the status every second keeps the model of an idle printer current (its media, and the end
+				// of cooling, which nobody else would read)
+				bool cooling = worker.runner->thermal().isCooling();
+				if (!cooling && m_cv.wait_for(lock, std::chrono::seconds{1}) == std::cv_status::no_timeout)
+					continue;
+				if (m_stopping || !worker.queue.empty())
+					continue;
+				lock.unlock();
+				auto error = worker.runner->idle(Clock::now() + std::chrono::milliseconds{100});
+				lock.lock();
+				if (!error.empty())
+					takeOutOfService(worker, error);
+				m_cv.notify_all();
+			}
+		}
+	}
+
+	std::vector<std::unique_ptr<Worker>> m_workers;
+	size_t m_renderWorkers;
+	RenderCache *m_cache;
+	PayloadCache *m_memory;
+	Listener m_listener;
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	bool m_stopping = false;
+	std::string m_error;
+	std::deque<Pending> m_pending;  // rendered, waiting for a printer with room
+	std::ostream *m_log = nullptr;
+	size_t m_printed = 0;
+	size_t m_failed = 0;
+	size_t m_rerouted = 0;
+	Clock::duration m_totalGap{};
+	size_t m_gaps = 0;
+	Clock::duration m_heldBack{};
+};
+
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <string>
+#include <thread>
+
+#include "commands.hpp"
+#include "device.hpp"
+#include "spool.hpp"
+#include "status.hpp"
+
+
+namespace bp {
+
+// Sends a job while listening to the status frames the printer sends back. Data goes out in whole commands only, so
+// when the printer reports a full buffer (or a transient communication error) the sender stops on a raster line
+// boundary, asks for the status until the condition is gone and carries on with the next byte. Any other error
+// stops the job.
+class MonitoredSender {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	static const size_t ChunkSize = 16 * 1024;
+	static const uint16_t PausingErrors = 0x0e00;  // expansion buffer, communication, communication buffer full
+	static const uint16_t Warnings = 0x0048;  // weak batteries, high voltage adapter
+
+	struct Progress {
+		uint64_t bytes = 0;  // written so far, the job continues with the next one
+		uint64_t rasterLines = 0;
+		unsigned pauses = 0;
+		Clock::duration paused{};
+	};
+
+	MonitoredSender(int device, std::chrono::milliseconds resumeTimeout, std::chrono::milliseconds statusInterval = std::chrono::milliseconds{100})
+		: m_device(device), m_resumeTimeout(resumeTimeout), m_statusInterval(statusInterval)
+	{
+		m_framer.subscribe([this](const Status &status) { update(status); });
+	}
+
+	// writes data, which has to consist of whole commands, error message on failure
+	std::string send(const uint8_t *data, size_t size)
+	{
+		size_t pos = 0;
+		while (pos < size) {
+			if (!receive(Clock::now()))
+				return std::format("failed to read status: {}", std::strerror(errno));
+			if (m_blocked && !m_failed) {
+				if (auto error = waitWhileBlocked(); !error.empty())
+					return error;
+			}
+			if (m_failed)
+				return std::format("printer reported '{}'", m_latest.errorStr());
+
+			size_t end = pos;
+			uint64_t lines = 0;
+			while (end < size && end - pos < ChunkSize) {
+				size_t n = commandSize(data, size, end);
+				if (n == 0)
+					return std::format("unrecognised or truncated command at byte {}", m_progress.bytes + end - pos);
+				if (data[end] == 'G' || data[end] == 'Z')
+					++lines;
+				end += n;
+			}
+
+			if (!writeAll(m_device, data + pos, end - pos))
+				return std::format("failed to write: {}", std::strerror(errno));
+			m_progress.bytes += end - pos;
+			m_progress.rasterLines += lines;
+			pos = end;
+		}
+
+		return {};
+	}
+
+	const Progress & progress() const
+	{
+		return m_progress;
+	}
+
+	// anything but a full buffer, a transient communication error or a warning
+	static bool isFatal(const Status &status)
+	{
+		uint16_t bits = status.errorBits() & ~Warnings;
+		return (bits & ~PausingErrors) || !lookup(Status::ExtendedErrors, status.extendedError).empty();
+	}
+
+	// the consumer sees every status frame read from the device, while sending or in receive()
+	void subscribe(StatusFramer::Consumer consumer)
+	{
+		m_framer.subscribe(std::move(consumer));
+	}
+
+	// waits until a frame arrives or the deadline passes and picks up whatever else is there, false if reading the device failed
+	bool receive(Clock::time_point deadline)
+	{
+		while (pumpStatus(m_device, m_framer, deadline))
+			deadline = Clock::now();
+		return errno == ETIMEDOUT;
+	}
+
+private:
+	void update(const Status &status)
+	{
+		m_latest = status;
+		m_blocked = status.errorBits() & PausingErrors;
+		m_failed = isFatal(status);
+	}
+
+	// nothing is written in the meantime, so the status request can't end up inside a command
+	std::string waitWhileBlocked()
+	{
+		++m_progress.pauses;
+		auto start = Clock::now();
+		while (m_blocked && !m_failed) {
+			if (Clock::now() - start > m_resumeTimeout)
+				return std::format("printer still reports '{}' after {} ms", m_latest.errorStr(), m_resumeTimeout.count());
+
+			auto next = Clock::now() + m_statusInterval;
+			if (!writeStruct(m_device, StatusRequest{}))
+				return std::format("failed to request status: {}", std::strerror(errno));
+			if (!receive(next))
+				return std::format("failed to read status: {}", std::strerror(errno));
+			std::this_thread::sleep_until(next);
+		}
+		m_progress.paused += Clock::now() - start;
+
+		return {};
+	}
+
+	int m_device;
+	std::chrono::milliseconds m_resumeTimeout;
+	std::chrono::milliseconds m_statusInterval;
+	StatusFramer m_framer;
+	Status m_latest{};
+	bool m_blocked = false;
+	bool m_failed = false;
+	Progress m_progress;
+};
+
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <string>
+#include <string_view>
+
+
+namespace bp {
+
+// FIPS 180-4 SHA-256, for naming content by its hash
+class Sha256 {
+public:
+	using Digest = std::array<uint8_t, 32>;
+
+	Sha256 & update(const void *data, size_t size)
+	{
+		auto bytes = static_cast<const uint8_t *>(data);
+		m_length += size;
+		while (size > 0) {
+			size_t n = std::min(size, sizeof m_block - m_used);
+			std::memcpy(m_block + m_used, bytes, n);
+			m_used += n;
+			bytes += n;
+			size -= n;
+			if (m_used == sizeof m_block) {
+				transform();
+				m_used = 0;
+			}
+		}
+		return *this;
+	}
+
+	Sha256 & update(std::string_view str)
+	{
+		return update(str.data(), str.size());
+	}
+
+	// finishes the hash, nothing can be added afterwards
+	Digest digest()
+	{
+		uint64_t bits = m_length * 8;
+		uint8_t padding = 0x80;
+		update(&padding, 1);
+		padding = 0;
+		while (m_used != sizeof m_block - 8)
+			update(&padding, 1);
+		for (int i = 7; i >= 0; --i)
+			m_block[m_used++] = bits >> (8 * i);
+		transform();
+
+		Digest digest;
+		for (size_t i = 0; i < 8; ++i) {
+			for (size_t j = 0; j < 4; ++j)
+				digest[4 * i + j] = m_state[i] >> (24 - 8 * j);
+		}
+		return digest;
+	}
+
+	std::string hexDigest()
+	{
+		std::string hex;
+		for (uint8_t b : digest())
+			hex += std::format("{:02x}", b);
+		return hex;
+	}
+
+private:
+	static uint32_t rotr(uint32_t x, unsigned n)
+	{
+		return x >> n | x << (32 - n);
+	}
+
+	void transform()
+	{
+		static constexpr uint32_t K[64] = {
+			0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+			0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+			0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+			0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+			0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+			0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+			0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+			0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+		};
+
+		uint32_t w[64];
+		for (size_t i = 0; i < 16; ++i)
+			w[i] = uint32_t{m_block[4 * i]} << 24 | uint32_t{m_block[4 * i + 1]} << 16 | uint32_t{m_block[4 * i + 2]} << 8 | m_block[4 * i + 3];
+		for (size_t i = 16; i < 64; ++i) {
+			uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ w[i - 15] >> 3;
+			uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ w[i - 2] >> 10;
+			w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+		}
+
+		uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3];
+		uint32_t e = m_state[4], f = m_state[5], g = m_state[6], h = m_state[7];
+		for (size_t i = 0; i < 64; ++i) {
+			uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+			uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+		m_state[0] += a;
+		m_state[1] += b;
+		m_state[2] += c;
+		m_state[3] += d;
+		m_state[4] += e;
+		m_state[5] += f;
+		m_state[6] += g;
+		m_state[7] += h;
+	}
+
+	uint32_t m_state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+	uint8_t m_block[64];
+	size_t m_used = 0;
+	uint64_t m_length = 0;
+};
+
+}
@@ -0,0 +1,384 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "commands.hpp"
+#include "device.hpp"
+
+
+// A spool file is any number of print requests appended one after another, each page ending with a 0x0c or 0x1a marker.
+// The sidecar index (<spool>.idx) lists where every page starts so that a page can be reached without parsing the ones before it.
+
+namespace bp {
+
+struct SpoolPage {
+	uint64_t offset = 0;  // first byte of the page in the spool file
+	uint32_t size = 0;  // bytes, including the page end marker
+	uint32_t rasterCount = 0;  // 'G' and 'Z' lines
+	uint16_t pageIndexOffset = 0;  // PrintInformationCommand::pageIndex, relative to offset
+	uint8_t compression = SelectCompressionMode::NoCompression;
+	uint8_t mediaType = 0;
+	uint8_t mediaWidth = 0;
+	uint8_t pageIndex = PrintInformationCommand::Last;
+	uint8_t marker = 0x1a;
+	uint8_t reserved = 0;
+
+	uint64_t end() const
+	{
+		return offset + size;
+	}
+};
+
+static_assert(sizeof(SpoolPage) == 24);
+
+struct SpoolIndex {
+	uint64_t spoolSize = 0;  // bytes of the spool file covered by the index
+	int64_t spoolMtime = 0;  // ns, modification time of the spool file the index was written for
+	std::vector<SpoolPage> pages;
+};
+
+struct SpoolIndexHeader {
+	char magic[4] = {'B', 'P', 'S', 'I'};
+	uint32_t version = 2;
+	uint64_t spoolSize = 0;
+	int64_t spoolMtime = 0;
+	uint32_t pages = 0;
+	uint32_t reserved = 0;
+};
+
+static_assert(sizeof(SpoolIndexHeader) == 32);
+
+inline std::string indexPath(const std::string &spoolPath)
+{
+	return spoolPath + ".idx";
+}
+
+// size of an ESC i <command> sequence, 0 if the command isn't known
+constexpr size_t escapeCommandSize(uint8_t command)
+{
+	switch (command) {
+		case 'S': return sizeof(StatusRequest);
+		case 'z': return sizeof(PrintInformationCommand);
+		case 'a':
+		case 'M':
+		case 'A':
+		case 'K': return 4;
+		case 'd': return 5;
+		case 'U': return 18;
+		case 'k': return 6;
+		default: return 0;
+	}
+}
+
+// size of the command starting at buf[i], 0 if it is truncated or not known
+inline size_t commandSize(const uint8_t *buf, size_t len, size_t i)
+{
+	size_t size = 0;
+	switch (buf[i]) {
+		case 0x00:
+		case 0x0c:
+		case 0x1a:
+		case 'Z':
+			size = 1;
+			break;
+		case 'M':
+			size = 2;
+			break;
+		case 'G':
+			if (i + 2 < len)
+				size = 3 + buf[i + 1] + buf[i + 2] * 256;
+			break;
+		case ESCAPE:
+			if (i + 1 < len && buf[i + 1] == '@')
+				size = 2;
+			else if (i + 2 < len && buf[i + 1] == 'i')
+				size = escapeCommandSize(buf[i + 2]);
+			break;
+	}
+	return i + size <= len ? size : 0;
+}
+
+// appends the pages found in buf (which starts at spool offset base) to the index
+inline std::string scanSpool(const uint8_t *buf, size_t len, uint64_t base, SpoolIndex &index)
+{
+	SpoolPage page;
+	bool inPage = false;
+	auto startPage = [&](size_t i) {
+		if (!inPage) {
+			page = SpoolPage{};
+			page.offset = base + i;
+			inPage = true;
+		}
+	};
+
+	size_t i = 0;
+	while (i < len) {
+		uint8_t c = buf[i];
+		if (c == 0x00 && !inPage) {
+			++i;  // invalidate
+		} else if (c == ESCAPE) {
+			if (i + 1 < len && buf[i + 1] == '@') {
+				i += 2;
+				continue;
+			}
+			if (i + 2 >= len)
+				return std::format("truncated command at offset {}", base + i);
+			if (buf[i + 1] != 'i')
+				return std::format("unrecognised command at offset {}", base + i);
+
+			size_t size = escapeCommandSize(buf[i + 2]);
+			if (size == 0)
+				return std::format("unrecognised command at offset {}", base + i);
+			if (i + size > len)
+				return std::format("truncated command at offset {}", base + i);
+
+			if (buf[i + 2] != 'S')
+				startPage(i);
+			if (buf[i + 2] == 'z') {
+				page.mediaType = buf[i + offsetof(PrintInformationCommand, mediaType)];
+				page.mediaWidth = buf[i + offsetof(PrintInformationCommand, mediaWidth)];
+				page.pageIndex = buf[i + offsetof(PrintInformationCommand, pageIndex)];
+				page.pageIndexOffset = base + i + offsetof(PrintInformationCommand, pageIndex) - page.offset;
+			}
+			i += size;
+		} else if (c == 'M') {
+			startPage(i);
+			if (i + 1 >= len)
+				return std::format("truncated compression mode at offset {}", base + i);
+			page.compression = buf[i + 1];
+			i += 2;
+		} else if (c == 'G') {
+			startPage(i);
+			if (i + 2 >= len)
+				return std::format("truncated raster line at offset {}", base + i);
+			i += 3 + buf[i + 1] + buf[i + 2] * 256;
+			++page.rasterCount;
+		} else if (c == 'Z') {
+			startPage(i);
+			++i;
+			++page.rasterCount;
+		} else if (c == 0x0c || c == 0x1a) {
+			if (!inPage)
+				return std::format("page end marker outside of a page at offset {}", base + i);
+			page.marker = c;
+			page.size = base + i + 1 - page.offset;
+			index.pages.push_back(page);
+			inPage = false;
+			++i;
+		} else {
+			return std::format("unexpected byte 0x{:02x} at offset {}", c, base + i);
+		}
+	}
+
+	if (i > len)
+		return std::format("truncated raster line at the end of the spool ({} bytes)", base + len);
+	if (inPage)
+		return std::format("unterminated page at offset {}", page.offset);
+
+	index.spoolSize = base + len;
+	return {};
+}
+
+inline int64_t modifiedAt(const struct stat &st)
+{
+	return st.st_mtim.tv_sec * int64_t{1'000'000'000} + st.st_mtim.tv_nsec;
+}
+
+// brings the index up to date with the spool file, only the part not covered yet is scanned; an index
+// written for a different modification time may belong to a rewritten file and is rebuilt from scratch
+inline std::string updateSpoolIndex(const std::string &spoolPath, SpoolIndex &index)
+{
+	int fd = ::open(spoolPath.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return std::format("failed to open '{}': {}", spoolPath, std::strerror(errno));
+
+	struct stat st;
+	if (::fstat(fd, &st) < 0) {
+		auto error = std::format("failed to stat '{}': {}", spoolPath, std::strerror(errno));
+		::close(fd);
+		return error;
+	}
+	off_t size = st.st_size;
+	if (static_cast<uint64_t>(size) < index.spoolSize || modifiedAt(st) != index.spoolMtime)
+		index = SpoolIndex{};
+	index.spoolMtime = modifiedAt(st);
+
+	std::string error;
+	if (size > 0 && static_cast<uint64_t>(size) > index.spoolSize) {
+		void *data = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			error = std::format("failed to map '{}': {}", spoolPath, std::strerror(errno));
+		} else {
+			::madvise(data, size, MADV_SEQUENTIAL);
+			auto begin = static_cast<const uint8_t *>(data) + index.spoolSize;
+			error = scanSpool(begin, size - index.spoolSize, index.spoolSize, index);
+			::munmap(data, size);
+		}
+	}
+	::close(fd);
+
+	return error;
+}
+
+// a missing index is no error, the index is left empty and the spool is scanned in full; so it is after
+// any error, which the caller only has to report
+inline std::string readSpoolIndex(const std::string &path, SpoolIndex &index)
+{
+	index = SpoolIndex{};
+	std::ifstream in{path, std::ios::binary | std::ios::ate};
+	if (!in)
+		return errno == ENOENT ? std::string{} : std::format("failed to open '{}': {}", path, std::strerror(errno));
+	auto fileSize = static_cast<uint64_t>(in.tellg());
+	in.seekg(0);
+
+	SpoolIndexHeader header;
+	in.read(reinterpret_cast<char *>(&header), sizeof header);
+	if (!in || std::string_view{header.magic, 4} != "BPSI" || header.version != SpoolIndexHeader{}.version)
+		return std::format("'{}' is not a spool index", path);
+	if (fileSize != sizeof header + uint64_t{header.pages} * sizeof(SpoolPage))
+		return std::format("spool index '{}' has {} bytes, not the {} pages it claims", path, fileSize, header.pages);
+
+	index.pages.resize(header.pages);
+	in.read(reinterpret_cast<char *>(index.pages.data()), index.pages.size() * sizeof(SpoolPage));
+	if (!in) {
+		index = SpoolIndex{};
+		return std::format("failed to read '{}'", path);
+	}
+	index.spoolSize = header.spoolSize;
+	index.spoolMtime = header.spoolMtime;
+
+	return {};
+}
+
+// the index is stamped with the current modification time of the spool, so it has to be written after
+// the spool is complete
+inline std::string writeSpoolIndex(const std::string &path, const std::string &spoolPath, const SpoolIndex &index)
+{
+	struct stat st;
+	if (::stat(spoolPath.c_str(), &st) < 0)
+		return std::format("failed to stat '{}': {}", spoolPath, std::strerror(errno));
+
+	// written aside and renamed, readers never see a half-written index
+	auto tmpPath = path + ".tmp";
+	{
+		std::ofstream out{tmpPath, std::ios::binary | std::ios::trunc};
+		SpoolIndexHeader header;
+		header.spoolSize = index.spoolSize;
+		header.spoolMtime = modifiedAt(st);
+		header.pages = index.pages.size();
+		out.write(reinterpret_cast<const char *>(&header), sizeof header);
+		out.write(reinterpret_cast<const char *>(index.pages.data()), index.pages.size() * sizeof(SpoolPage));
+		if (!out)
+			return std::format("failed to write '{}'", tmpPath);
+	}
+	if (::rename(tmpPath.c_str(), path.c_str()) < 0)
+		return std::format("failed to write '{}': {}", path, std::strerror(errno));
+
+	return {};
+}
+
+// sends a page straight from the spool file with its page index and end marker replaced
+inline bool sendPage(int out, int in, const SpoolPage &page, uint8_t pageIndex, uint8_t marker)
+{
+	if (page.pageIndexOffset == 0)
+		return sendFile(out, in, page.offset, page.size - 1) && writeAll(out, &marker, 1);
+
+	uint64_t pageIndexAt = page.offset + page.pageIndexOffset;
+	return sendFile(out, in, page.offset, page.pageIndexOffset)
+		&& writeAll(out, &pageIndex, 1)
+		&& sendFile(out, in, pageIndexAt + 1, page.end() - 1 - (pageIndexAt + 1))
+		&& writeAll(out, &marker, 1);
+}
+
+// writes the pages of all the spools as one job: the preamble of the first spool, then every page with its
+// page index and end marker rewritten, nothing is rasterized again
+inline std::string mergeSpools(int out, const std::vector<std::string> &spoolPaths, SpoolIndex *outIndex = nullptr)
+{
+	struct Input {
+		int fd;
+		SpoolIndex index;
+	};
+	std::vector<Input> inputs;
+	auto closeInputs = [&inputs] {
+		for (auto &input : inputs)
+			::close(input.fd);
+	};
+
+	size_t pageCount = 0;
+	for (const auto &path : spoolPaths) {
+		Input input;
+		// an unusable index only costs a full scan
+		readSpoolIndex(indexPath(path), input.index);
+		if (auto error = updateSpoolIndex(path, input.index); !error.empty()) {
+			closeInputs();
+			return std::format("failed to index '{}': {}", path, error);
+		}
+		input.fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (input.fd < 0) {
+			closeInputs();
+			return std::format("failed to open '{}': {}", path, std::strerror(errno));
+		}
+		pageCount += input.index.pages.size();
+		inputs.push_back(std::move(input));
+	}
+
+	if (pageCount == 0) {
+		closeInputs();
+		return "no pages to merge";
+	}
+
+	uint64_t position = outIndex ? outIndex->spoolSize : 0;
+	auto write = [&](uint64_t size, auto fn) {
+		if (!fn())
+			return false;
+		position += size;
+		return true;
+	};
+
+	const auto &first = inputs.front();
+	uint64_t preambleSize = first.index.pages.empty() ? 0 : first.index.pages.front().offset;
+	bool ok = write(preambleSize, [&] { return sendFile(out, first.fd, 0, preambleSize); });
+
+	size_t pageNr = 0;
+	for (const auto &input : inputs) {
+		for (const auto &page : input.index.pages) {
+			if (!ok)
+				break;
+
+			SpoolPage merged = page;
+			merged.offset = position;
+			if (pageNr + 1 == pageCount)
+				merged.pageIndex = PrintInformationCommand::Last;
+			else if (pageNr == 0)
+				merged.pageIndex = PrintInformationCommand::Starting;
+			else
+				merged.pageIndex = PrintInformationCommand::Other;
+			merged.marker = pageNr + 1 == pageCount ? 0x1a : 0x0c;
+
+			ok = write(page.size, [&] { return sendPage(out, input.fd, page, merged.pageIndex, merged.marker); });
+			if (outIndex)
+				outIndex->pages.push_back(merged);
+			++pageNr;
+		}
+	}
+	closeInputs();
+
+	if (!ok)
+		return std::format("failed to write merged job: {}", std::strerror(errno));
+	if (outIndex)
+		outIndex->spoolSize = position;
+
+	return {};
+}
+
+}
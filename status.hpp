@@ -0,0 +1,628 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <poll.h>
+#include <unistd.h>
+
+#include "json.hpp"
+
+
+template <class T>
+struct Code {
+	T value;
+	std::string_view name;
+};
+
+template <class T, size_t N>
+constexpr std::string_view lookup(const Code<T> (&table)[N], T value, std::string_view fallback = {})
+{
+	for (const auto &code : table) {
+		if (code.value == value)
+			return code.name;
+	}
+	return fallback;
+}
+
+struct Status {
+	struct Error {
+		bool noMedia : 1;
+		bool endOfMedia : 1;
+		bool cutterJam : 1;
+		bool weakBatteries : 1;
+		bool printerInUse : 1;
+		bool notUsed1 : 1;
+		bool highVoltageAdapter : 1;
+		bool notUsed2 : 1;
+		bool replaceMedia : 1;
+		bool expansionBuffer : 1;
+		bool communication : 1;
+		bool communicationBufferFull : 1;
+		bool coverOpen : 1;
+		bool overheating : 1;
+		bool blackMarkingNotDetected : 1;
+		bool systemError : 1;
+	};
+
+	enum class ExtendedError : uint8_t {
+		FleTapeEnd = 0x10,
+		HighResolutionOrDraftPrintingError = 0x1d,
+		AdapterPullOrInsertError = 0x1e,
+		IncompatibleMediaError = 0x21,
+	};
+
+	enum class StatusType : uint8_t {
+		ReplyToStatusRequest = 0x00,
+		PrintingCompleted = 0x01,
+		ErrorOccurred = 0x02,
+		ExitIFMode = 0x03,
+		TurnedOff = 0x04,
+		Notification = 0x05,
+		PhaseChange = 0x06,
+	};
+
+	enum class NotificationNumber : uint8_t {
+		NotAvailable = 0x00,
+		CoverOpen = 0x01,
+		CoverClosed = 0x02,
+		CoolingStarted = 0x03,
+		CoolingFinished = 0x04,
+	};
+
+	enum class TapeColourInformation : uint8_t {
+		White = 0x01,
+		Other = 0x02,
+		Clear = 0x03,
+		Red = 0x04,
+		Blue = 0x05,
+		Yellow = 0x06,
+		Green = 0x07,
+		Black = 0x08,
+		ClearWhiteText = 0x09,
+		MatteWhite = 0x20,
+		MatteClear = 0x21,
+		MatteSilver = 0x22,
+		SatinGold = 0x23,
+		SatinSilver = 0x24,
+		BlueD = 0x30,
+		RedD = 0x31,
+		FluorescentOrange = 0x40,
+		FluorescentYellow = 0x41,
+		BerryPinkS = 0x50,
+		LightGrayS = 0x51,
+		YellowF = 0x60,
+		PinkF = 0x61,
+		BlueF = 0x62,
+		WhiteHSTube = 0x70,
+		WhiteFlexID = 0x90,
+		YellowFlexID = 0x91,
+		Cleaning = 0xf0,
+		Stencil = 0xf1,
+		Incompatible = 0xff,
+	};
+
+	enum class TextColourInformation : uint8_t {
+		White = 0x01,
+		Other = 0x02,
+		Red = 0x04,
+		Blue = 0x05,
+		Black = 0x08,
+		Gold = 0x0a,
+		BlueF = 0x62,
+		Cleaning = 0xf0,
+		Stencil = 0xf1,
+		Incompatible = 0xff,
+	};
+
+	enum class BatteryLevel : uint8_t {
+		Full = 0x00,
+		Half = 0x01,
+		Low = 0x02,
+		NeedToBeCharged = 0x03,
+		UsingAcAdapter = 0x04,
+		Unknown = 0xff,
+	};
+
+	uint8_t printHeadMark;
+	uint8_t size;
+	uint8_t brotherCode, seriesCode, modelCode, countryCode;
+	BatteryLevel batteryLevel;
+	ExtendedError extendedError;
+	Error error;
+	uint8_t mediaWidth, mediaType;
+	uint8_t numberOfColours;
+	uint8_t fonts, japaneseFonts;
+	uint8_t mode;
+	uint8_t density;
+	uint8_t mediaLength;
+	StatusType statusType;
+	uint8_t phaseType, phaseNumber0, phaseNumber1;
+	NotificationNumber notificationNumber;
+	uint8_t expansionArea;
+	TapeColourInformation tapeColourInformation;
+	TextColourInformation textColourInformation;
+	uint8_t reserved[6];
+
+	static constexpr Code<uint8_t> ModelCodes[] = {
+		{0x71, "PT-P900"},
+		{0x69, "PT-P900W"},
+		{0x70, "PT-P950NW"},
+		{0x78, "PT-P910BT"},
+	};
+
+	// error information bits, byte 8 is the low byte
+	static constexpr Code<uint16_t> Errors[] = {
+		{0x0001, "no media"},
+		{0x0002, "end of media"},
+		{0x0004, "cutter jam"},
+		{0x0008, "weak batteries"},
+		{0x0010, "printer in use"},
+		{0x0040, "high voltage adapter"},
+		{0x0100, "replace media"},
+		{0x0200, "expansion buffer"},
+		{0x0400, "communication"},
+		{0x0800, "communication buffer full"},
+		{0x1000, "cover open"},
+		{0x2000, "overheating"},
+		{0x4000, "black marking not detected"},
+		{0x8000, "system error"},
+	};
+
+	static constexpr Code<ExtendedError> ExtendedErrors[] = {
+		{ExtendedError::FleTapeEnd, "Fle tape end"},
+		{ExtendedError::HighResolutionOrDraftPrintingError, "High-resolution/draft printing error"},
+		{ExtendedError::AdapterPullOrInsertError, "Adapter pull/insert error"},
+		{ExtendedError::IncompatibleMediaError, "Incompatible media error"},
+	};
+
+	static constexpr Code<uint8_t> MediaWidths[] = {
+		{0x00, "no tape"},
+		{0x04, "3.5 mm"},
+		{0x06, "6 mm / HS 5.8 mm"},
+		{0x09, "9 mm / HS 8.8 mm"},
+		{0x0c, "12 mm / HS 11.7 mm"},
+		{0x12, "18 mm / HS 17.7 mm"},
+		{0x18, "24 mm / HS 23.6 mm"},
+		{0x24, "36 mm"},
+		{0x15, "FLe 21 mm x 45 mm"},
+	};
+
+	static constexpr Code<uint8_t> MediaTypes[] = {
+		{0x00, "no media"},
+		{0x01, "laminated tape"},
+		{0x03, "non-laminated tape"},
+		{0x04, "fabric tape"},
+		{0x11, "heat-shrink tube"},
+		{0x13, "Fle tape"},
+		{0x14, "Flexible ID table"},
+		{0x15, "Satin tape"},
+		{0x17, "Heat-Shrink Tube (HS 3:1)"},
+		{0xff, "incompatible tape"},
+	};
+
+	static constexpr Code<StatusType> StatusTypes[] = {
+		{StatusType::ReplyToStatusRequest, "reply to status request"},
+		{StatusType::PrintingCompleted, "printing completed"},
+		{StatusType::ErrorOccurred, "error occurred"},
+		{StatusType::TurnedOff, "turned off"},
+		{StatusType::Notification, "notification"},
+		{StatusType::PhaseChange, "phase changed"},
+	};
+
+	// phase type in the high byte, phase number (byte 21) in the low one
+	static constexpr Code<uint16_t> Phases[] = {
+		{0x0000, "editing state"},
+		{0x0001, "feed"},
+		{0x0100, "printing"},
+		{0x010a, "(not used)"},
+		{0x0114, "cover open while receiving"},
+		{0x0119, "(not used)"},
+	};
+
+	static constexpr Code<NotificationNumber> Notifications[] = {
+		{NotificationNumber::NotAvailable, "not available"},
+		{NotificationNumber::CoverOpen, "cover open"},
+		{NotificationNumber::CoverClosed, "cover closed"},
+		{NotificationNumber::CoolingStarted, "cooling (started)"},
+		{NotificationNumber::CoolingFinished, "cooling (finished)"},
+	};
+
+	static constexpr Code<TapeColourInformation> TapeColours[] = {
+		{TapeColourInformation::White, "white"},
+		{TapeColourInformation::Other, "other"},
+		{TapeColourInformation::Clear, "clear"},
+		{TapeColourInformation::Red, "red"},
+		{TapeColourInformation::Blue, "blue"},
+		{TapeColourInformation::Yellow, "yellow"},
+		{TapeColourInformation::Green, "green"},
+		{TapeColourInformation::Black, "black"},
+		{TapeColourInformation::ClearWhiteText, "clear white text"},
+		{TapeColourInformation::MatteWhite, "matte white"},
+		{TapeColourInformation::MatteClear, "matte clear"},
+		{TapeColourInformation::MatteSilver, "matte silver"},
+		{TapeColourInformation::SatinGold, "satin gold"},
+		{TapeColourInformation::SatinSilver, "satin silver"},
+		{TapeColourInformation::BlueD, "blue (D)"},
+		{TapeColourInformation::RedD, "red (D)"},
+		{TapeColourInformation::FluorescentOrange, "fluorescent orange"},
+		{TapeColourInformation::FluorescentYellow, "fluorescent yellow"},
+		{TapeColourInformation::BerryPinkS, "berry pink (S)"},
+		{TapeColourInformation::LightGrayS, "light gray (S)"},
+		{TapeColourInformation::YellowF, "yellow (F)"},
+		{TapeColourInformation::PinkF, "pink (F)"},
+		{TapeColourInformation::BlueF, "blue (F)"},
+		{TapeColourInformation::WhiteHSTube, "white (Heat-shrink Tube)"},
+		{TapeColourInformation::WhiteFlexID, "white (Flex. ID)"},
+		{TapeColourInformation::YellowFlexID, "yellow (Flex. ID)"},
+		{TapeColourInformation::Cleaning, "cleaning"},
+		{TapeColourInformation::Stencil, "stencil"},
+		{TapeColourInformation::Incompatible, "incompatible"},
+	};
+
+	static constexpr Code<TextColourInformation> TextColours[] = {
+		{TextColourInformation::White, "white"},
+		{TextColourInformation::Other, "other"},
+		{TextColourInformation::Red, "red"},
+		{TextColourInformation::Blue, "blue"},
+		{TextColourInformation::Black, "black"},
+		{TextColourInformation::Gold, "gold"},
+		{TextColourInformation::BlueF, "blue (F)"},
+		{TextColourInformation::Cleaning, "cleaning"},
+		{TextColourInformation::Stencil, "stencil"},
+		{TextColourInformation::Incompatible, "incompatible"},
+	};
+
+	static constexpr Code<BatteryLevel> BatteryLevels[] = {
+		{BatteryLevel::Full, "full"},
+		{BatteryLevel::Half, "half"},
+		{BatteryLevel::Low, "low"},
+		{BatteryLevel::NeedToBeCharged, "needs to be charged"},
+		{BatteryLevel::UsingAcAdapter, "using AC adapter"},
+		{BatteryLevel::Unknown, "unknown"},
+	};
+
+	uint16_t errorBits() const
+	{
+		uint16_t bits;
+		std::memcpy(&bits, &error, sizeof bits);
+		return bits;
+	}
+
+	// names of all the errors reported, including the extended one
+	std::vector<std::string_view> errors() const
+	{
+		std::vector<std::string_view> names;
+		uint16_t bits = errorBits();
+		for (const auto &e : Errors) {
+			if (bits & e.value)
+				names.push_back(e.name);
+		}
+		if (auto name = lookup(ExtendedErrors, extendedError); !name.empty())
+			names.push_back(name);
+		return names;
+	}
+
+	// no error and waiting for a job
+	bool isReady() const
+	{
+		return errorBits() == 0 && lookup(ExtendedErrors, extendedError).empty() && phaseType == 0x00 && phaseNumber1 == 0x00;
+	}
+
+	std::string_view modelCodeStr() const
+	{
+		return lookup(ModelCodes, modelCode, "unrecognised");
+	}
+
+	std::string errorStr() const
+	{
+		std::string errMsg;
+		for (auto name : errors()) {
+			if (!errMsg.empty())
+				errMsg += ", ";
+			errMsg += name;
+		}
+		return errMsg;
+	}
+
+	std::string mediaWidthStr() const
+	{
+		if (auto name = lookup(MediaWidths, mediaWidth); !name.empty())
+			return std::string{name};
+		return "unrecognised tape width: " + std::to_string(static_cast<unsigned>(mediaWidth));
+	}
+
+	std::string mediaTypeStr() const
+	{
+		if (auto name = lookup(MediaTypes, mediaType); !name.empty())
+			return std::string{name};
+		return "unrecognised tape type: " + std::to_string(static_cast<unsigned>(mediaType));
+	}
+
+	std::string_view statusStr() const
+	{
+		if (auto name = lookup(StatusTypes, statusType); !name.empty())
+			return name;
+		if (static_cast<uint8_t>(statusType) < 0x21)
+			return "(not used)";
+		return "(reserved)";
+	}
+
+	std::string_view phaseStr() const
+	{
+		if (auto name = lookup(Phases, static_cast<uint16_t>(phaseType << 8 | phaseNumber1)); !name.empty())
+			return name;
+		if (phaseType == 0x00)
+			return "unrecognised editing state";
+		if (phaseType == 0x01)
+			return "unrecognised printing state";
+		return "unrecognised phase type";
+	}
+
+	std::string_view notificationStr() const
+	{
+		return lookup(Notifications, notificationNumber, "unrecognised");
+	}
+
+	std::string tapeColourStr() const
+	{
+		if (auto name = lookup(TapeColours, tapeColourInformation); !name.empty())
+			return std::string{name};
+		return "unrecognised: " + std::to_string(static_cast<unsigned>(tapeColourInformation));
+	}
+
+	std::string textColourStr() const
+	{
+		if (auto name = lookup(TextColours, textColourInformation); !name.empty())
+			return std::string{name};
+		return "unrecognised: " + std::to_string(static_cast<unsigned>(textColourInformation));
+	}
+
+	std::string_view batteryLevelStr() const
+	{
+		return lookup(BatteryLevels, batteryLevel, "unrecognised");
+	}
+};
+
+static_assert(sizeof(Status) == 32u);
+
+// fixed-layout summary of a status frame for in-process consumers, raw codes as in Status
+struct StatusRecord {
+	uint8_t version = 1;
+	uint8_t ready = 0;
+	uint16_t errors = 0;  // Status::Errors bits
+	uint8_t extendedError = 0;
+	uint8_t statusType = 0;
+	uint8_t phaseType = 0;
+	uint8_t phaseNumber = 0;
+	uint8_t notification = 0;
+	uint8_t mediaWidth = 0;  // mm
+	uint8_t mediaType = 0;
+	uint8_t tapeColour = 0;
+	uint8_t textColour = 0;
+	uint8_t batteryLevel = 0;
+	uint8_t modelCode = 0;
+	uint8_t mode = 0;
+
+	StatusRecord() = default;
+
+	explicit StatusRecord(const Status &status)
+		: ready(status.isReady())
+		, errors(status.errorBits())
+		, extendedError(static_cast<uint8_t>(status.extendedError))
+		, statusType(static_cast<uint8_t>(status.statusType))
+		, phaseType(status.phaseType)
+		, phaseNumber(status.phaseNumber1)
+		, notification(static_cast<uint8_t>(status.notificationNumber))
+		, mediaWidth(status.mediaWidth)
+		, mediaType(status.mediaType)
+		, tapeColour(static_cast<uint8_t>(status.tapeColourInformation))
+		, textColour(static_cast<uint8_t>(status.textColourInformation))
+		, batteryLevel(static_cast<uint8_t>(status.batteryLevel))
+		, modelCode(status.modelCode)
+		, mode(status.mode)
+	{}
+};
+
+static_assert(sizeof(StatusRecord) == 16u);
+
+enum class StatusFormat {
+	Text,
+	Json,
+	Binary,
+};
+
+inline bool parseStatusFormat(std::string_view name, StatusFormat &format)
+{
+	static constexpr Code<StatusFormat> Formats[] = {
+		{StatusFormat::Text, "text"},
+		{StatusFormat::Json, "json"},
+		{StatusFormat::Binary, "binary"},
+	};
+	for (const auto &f : Formats) {
+		if (f.name == name) {
+			format = f.value;
+			return true;
+		}
+	}
+	return false;
+}
+
+// the same "label: value" lines manage.py reads
+inline void printStatus(std::ostream &out, const Status &status)
+{
+	out << "model code: " << status.modelCodeStr() << "\n";
+	out << "battery level: " << status.batteryLevelStr() << "\n";
+	out << "error information: " << status.errorStr() << "\n";
+	out << "media width: " << status.mediaWidthStr() << "\n";
+	out << "media type: " << status.mediaTypeStr() << "\n";
+	out << "mode: " << std::hex << static_cast<uint32_t>(status.mode) << std::dec << "\n";
+	out << "status: " << status.statusStr() << "\n";
+	out << "phase: " << status.phaseStr() << "\n";
+	out << "notification: " << status.notificationStr() << "\n";
+	out << "tape colour: " << status.tapeColourStr() << "\n";
+	out << "text colour: " << status.textColourStr() << "\n";
+}
+
+// one object per line, the keys are the labels of the text output
+inline void printStatusJson(std::ostream &out, const Status &status)
+{
+	{
+		bp::JsonObjectWriter json{out};
+		json.field("model code", status.modelCodeStr())
+			.field("battery level", status.batteryLevelStr())
+			.field("error information", status.errorStr())
+			.array("errors", status.errors())
+			.field("media width", status.mediaWidthStr())
+			.field("media type", status.mediaTypeStr())
+			.field("mode", status.mode)
+			.field("status", status.statusStr())
+			.field("phase", status.phaseStr())
+			.field("notification", status.notificationStr())
+			.field("tape colour", status.tapeColourStr())
+			.field("text colour", status.textColourStr())
+			.field("ready", status.isReady());
+	}
+	out << "\n";
+}
+
+inline void writeStatus(std::ostream &out, const Status &status, StatusFormat format)
+{
+	switch (format) {
+		case StatusFormat::Text:
+			printStatus(out, status);
+			break;
+		case StatusFormat::Json:
+			printStatusJson(out, status);
+			break;
+		case StatusFormat::Binary: {
+			StatusRecord record{status};
+			out.write(reinterpret_cast<const char *>(&record), sizeof record);
+			break;
+		}
+	}
+}
+
+// frames a continuous byte stream into status records and hands every record to the consumers,
+// bytes that don't belong to a frame are skipped until the next 0x80 0x20 'B' header
+class StatusFramer {
+public:
+	using Consumer = std::function<void(const Status &)>;
+
+	static constexpr uint8_t Header[3] = {0x80, 0x20, 'B'};
+
+	void subscribe(Consumer consumer)
+	{
+		m_consumers.push_back(std::move(consumer));
+	}
+
+	void feed(const uint8_t *data, size_t size)
+	{
+		for (size_t i = 0; i < size;) {
+			if (m_size < sizeof Header) {
+				if (data[i] == Header[m_size]) {
+					m_frame[m_size++] = data[i];
+				} else {
+					// the header bytes are all different, so a mismatch can only restart at the current byte
+					m_discarded += m_size;
+					m_size = 0;
+					if (data[i] == Header[0])
+						m_frame[m_size++] = data[i];
+					else
+						++m_discarded;
+				}
+				++i;
+				continue;
+			}
+
+			size_t n = std::min(sizeof m_frame - m_size, size - i);
+			std::memcpy(m_frame + m_size, data + i, n);
+			m_size += n;
+			i += n;
+
+			if (m_size == sizeof m_frame) {
+				Status status;
+				std::memcpy(&status, m_frame, sizeof status);
+				m_size = 0;
+				++m_frames;
+				for (const auto &consumer : m_consumers)
+					consumer(status);
+			}
+		}
+	}
+
+	// complete frames seen so far
+	uint64_t frames() const
+	{
+		return m_frames;
+	}
+
+	// bytes skipped while looking for a header
+	uint64_t discarded() const
+	{
+		return m_discarded;
+	}
+
+private:
+	uint8_t m_frame[sizeof(Status)];
+	size_t m_size = 0;
+	uint64_t m_frames = 0;
+	uint64_t m_discarded = 0;
+	std::vector<Consumer> m_consumers;
+};
+
+// feeds whatever the device sends to the framer until a frame is complete or the deadline passes,
+// false on timeout (errno = ETIMEDOUT) or error; a deadline that has passed already makes a single pass without waiting
+inline bool pumpStatus(int fd, StatusFramer &framer, std::chrono::steady_clock::time_point deadline)
+{
+	uint64_t frames = framer.frames();
+	uint8_t buf[512];
+	for (bool first = true; framer.frames() == frames; first = false) {
+		// rounded up, so that less than a millisecond left doesn't turn into polls that don't wait
+		auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+		if (left.count() <= 0 && !first) {
+			errno = ETIMEDOUT;
+			return false;
+		}
+
+		pollfd pfd{fd, POLLIN, 0};
+		int ready = ::poll(&pfd, 1, std::max<int64_t>(left.count(), 0));
+		if (ready < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		if (ready == 0)
+			continue;
+
+		ssize_t n = ::read(fd, buf, sizeof buf);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			return false;
+		}
+		if (n == 0) {
+			// the printer class driver reports no data as end of file, try again until the deadline
+			if (std::chrono::steady_clock::now() >= deadline) {
+				errno = ETIMEDOUT;
+				return false;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds{1});
+			continue;
+		}
+		framer.feed(buf, n);
+	}
+
+	return true;
+}
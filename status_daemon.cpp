@@ -0,0 +1,217 @@
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <memory>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ArgParser.hpp"
+#include "commands.hpp"
+#include "device.hpp"
+#include "status.hpp"
+#include "status_shm.hpp"
+
+
+using Clock = std::chrono::steady_clock;
+
+static volatile std::sig_atomic_t stopRequested = 0;
+static volatile std::sig_atomic_t dumpRequested = 0;
+
+static uint64_t microsecondsSince(uint64_t ns)
+{
+	uint64_t now = bp::steadyNowNs();
+	return now > ns ? (now - ns) / 1000 : 0;
+}
+
+// keeps the device open and the latest status in memory, every change is printed as a block of "label: value" lines
+class StatusMonitor {
+public:
+	StatusMonitor(int fd, StatusFormat format, bp::SharedStatusWriter *shared) : m_fd(fd), m_format(format), m_shared(shared)
+	{
+		// shared histograms outlive the daemon and can be read by anybody, local ones are only dumped on SIGUSR1
+		if (m_shared)
+			m_latencies = &m_shared->latencies();
+		else
+			m_latencies = m_localLatencies.get();
+		m_framer.subscribe([this](const Status &status) { update(status); });
+	}
+
+	bool requestStatus()
+	{
+		m_requestedNs = bp::steadyNowNs();
+		return bp::writeStruct(m_fd, StatusRequest{});
+	}
+
+	const bp::StatusLatencies & latencies() const
+	{
+		return *m_latencies;
+	}
+
+	// waits for frames until the deadline, true if at least one arrived, errno other than ETIMEDOUT means the device failed
+	bool receive(Clock::time_point deadline)
+	{
+		bool received = false;
+		while (!stopRequested && pumpStatus(m_fd, m_framer, deadline)) {
+			received = true;
+			deadline = Clock::now();  // only pick up what is already there
+		}
+		if (received || stopRequested)
+			errno = ETIMEDOUT;
+		return received;
+	}
+
+	bool isValid() const
+	{
+		return m_valid;
+	}
+
+	const Status & latest() const
+	{
+		return m_latest;
+	}
+
+private:
+	void update(const Status &status)
+	{
+		measure(status);
+
+		bool changed = !m_valid || std::memcmp(&m_latest, &status, sizeof status) != 0;
+		m_latest = status;
+		m_valid = true;
+		if (m_shared)
+			m_shared->publish(status);
+
+		if (changed) {
+			writeStatus(std::cout, status, m_format);
+			if (m_format == StatusFormat::Text)
+				std::cout << "\n";
+			std::cout.flush();
+		}
+	}
+
+	void measure(const Status &status)
+	{
+		if (status.statusType == Status::StatusType::ReplyToStatusRequest && m_requestedNs) {
+			m_latencies->statusRoundTrip.record(microsecondsSince(m_requestedNs));
+			m_requestedNs = 0;
+		}
+
+		bool printing = status.phaseType == 0x01;
+		if (printing && !m_printingSinceNs) {
+			m_printingSinceNs = bp::steadyNowNs();
+		} else if (!printing && m_printingSinceNs) {
+			m_latencies->printingPhase.record(microsecondsSince(m_printingSinceNs));
+			m_printingSinceNs = 0;
+		}
+
+		// make_request --shm marks the moment its last byte was written
+		if (status.statusType == Status::StatusType::PrintingCompleted && m_shared) {
+			if (uint64_t writtenNs = m_shared->takeJobWritten())
+				m_latencies->printCompletion.record(microsecondsSince(writtenNs));
+		}
+	}
+
+	int m_fd;
+	StatusFormat m_format;
+	bp::SharedStatusWriter *m_shared;
+	StatusFramer m_framer;
+	bool m_valid = false;
+	Status m_latest;
+	std::unique_ptr<bp::StatusLatencies> m_localLatencies = std::make_unique<bp::StatusLatencies>();
+	bp::StatusLatencies *m_latencies;
+	uint64_t m_requestedNs = 0;
+	uint64_t m_printingSinceNs = 0;
+};
+
+static void dumpLatencies(const bp::StatusLatencies &latencies, StatusFormat format)
+{
+	latencies.forEach([format](std::string_view name, const bp::LatencyHistogram &histogram) {
+		if (format == StatusFormat::Json)
+			bp::printHistogramJson(std::cerr, name, histogram);
+		else
+			bp::printHistogram(std::cerr, name, histogram);
+	});
+}
+
+int main(int argc, char **argv)
+{
+	ArgParser parser;
+	parser.addArgument(Arg{"-d"});
+	parser.addArgument(Arg{"--interval"}.setOptional());
+	parser.addArgument(Arg{"--timeout"}.setOptional());
+	parser.addArgument(Arg{"--once"}.setOptional().setCount(0));
+	parser.addArgument(Arg{"--format"}.setOptional());
+	parser.addArgument(Arg{"--shm"}.setOptional());
+
+	parser.parse(argc - 1, argv + 1);
+	if (!parser.isValid()) {
+		std::cerr << parser.getErrorMsg() << "\n";
+		return 1;
+	}
+
+	std::chrono::milliseconds interval{parser.has("--interval") ? std::stoi(parser.value("--interval")) : 1000};
+	std::chrono::milliseconds timeout{parser.has("--timeout") ? std::stoi(parser.value("--timeout")) : 500};
+
+	StatusFormat format = StatusFormat::Text;
+	if (parser.has("--format") && !parseStatusFormat(parser.value("--format"), format)) {
+		std::cerr << "Invalid format: " << parser.value("--format") << "\n";
+		return 1;
+	}
+
+	const auto &device = parser.value("-d");
+	int fd = ::open(device.c_str(), O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		std::cerr << "Failed to open '" << device << "': " << std::strerror(errno) << "\n";
+		return 1;
+	}
+
+	// the daemon is the only one talking to the device, everybody else reads the shared copy
+	bp::SharedStatusWriter shared;
+	if (parser.has("--shm") && !shared.open(parser.value("--shm"))) {
+		std::cerr << "Failed to open shared memory '" << parser.value("--shm") << "': " << std::strerror(errno) << "\n";
+		return 1;
+	}
+
+	std::signal(SIGINT, [](int) { stopRequested = 1; });
+	std::signal(SIGTERM, [](int) { stopRequested = 1; });
+	std::signal(SIGUSR1, [](int) { dumpRequested = 1; });
+
+	StatusMonitor monitor{fd, format, parser.has("--shm") ? &shared : nullptr};
+	while (!stopRequested) {
+		auto requestTime = Clock::now();
+		if (!monitor.requestStatus()) {
+			std::cerr << "Failed to request status from '" << device << "': " << std::strerror(errno) << "\n";
+			return 1;
+		}
+
+		if (!monitor.receive(requestTime + timeout)) {
+			if (errno != ETIMEDOUT) {
+				std::cerr << "Failed to read status from '" << device << "': " << std::strerror(errno) << "\n";
+				return 1;
+			}
+			std::cerr << "No status reply from '" << device << "' within " << timeout.count() << " ms\n";
+			if (parser.has("--once"))
+				return 1;
+		} else if (parser.has("--once")) {
+			break;
+		}
+
+		// unsolicited frames (phase changes, notifications, errors) are picked up until the next request
+		auto next = requestTime + interval;
+		while (!stopRequested && Clock::now() < next) {
+			if (!monitor.receive(next) && errno != ETIMEDOUT) {
+				std::cerr << "Failed to read status from '" << device << "': " << std::strerror(errno) << "\n";
+				return 1;
+			}
+			if (dumpRequested) {
+				dumpRequested = 0;
+				dumpLatencies(monitor.latencies(), format);
+			}
+		}
+	}
+
+	::close(fd);
+	return 0;
+}
@@ -0,0 +1,231 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "histogram.hpp"
+#include "status.hpp"
+
+
+// The status owner (status_daemon --shm) publishes every status frame into a shared-memory segment guarded by a seqlock,
+// any number of readers copy the latest one out without touching the device or blocking the owner.
+
+namespace bp {
+
+struct StatusSnapshot {
+	Status status;
+	uint64_t timestampNs = 0;  // steady clock, comparable between processes on the same host
+	uint64_t events = 0;  // status frames received by the owner so far
+};
+
+static_assert(sizeof(StatusSnapshot) % sizeof(uint64_t) == 0);
+
+// kept by the status owner for its device
+struct StatusLatencies {
+	LatencyHistogram statusRoundTrip;  // ESC i S written until the reply arrived
+	LatencyHistogram printingPhase;  // entering the printing phase until leaving it
+	LatencyHistogram printCompletion;  // last byte of a job written until "printing completed"
+
+	template <class Fn>
+	void forEach(Fn fn) const
+	{
+		fn("status round trip", statusRoundTrip);
+		fn("printing phase", printingPhase);
+		fn("print completion", printCompletion);
+	}
+};
+
+struct SharedStatusBlock {
+	static const uint32_t Magic = 0x53535042;  // "BPSS"
+	static const uint32_t Version = 2;
+	static const size_t Words = sizeof(StatusSnapshot) / sizeof(uint64_t);
+
+	uint32_t magic;
+	uint32_t version;
+	std::atomic<uint64_t> sequence;  // odd while an update is in progress
+	std::atomic<uint64_t> words[Words];  // StatusSnapshot, copied word by word
+	std::atomic<uint64_t> jobWrittenNs;  // set by a sender after the last byte of a job, taken by the owner
+	StatusLatencies latencies;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+inline uint64_t steadyNowNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class SharedStatusWriter {
+public:
+	SharedStatusWriter() = default;
+	SharedStatusWriter(const SharedStatusWriter &) = delete;
+	SharedStatusWriter & operator=(const SharedStatusWriter &) = delete;
+
+	~SharedStatusWriter()
+	{
+		if (m_block)
+			::munmap(m_block, sizeof(SharedStatusBlock));
+	}
+
+	// name as for shm_open, e.g. "/ptouch-lp1"
+	bool open(const std::string &name)
+	{
+		int fd = ::shm_open(name.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+		if (fd < 0)
+			return false;
+		if (::ftruncate(fd, sizeof(SharedStatusBlock)) < 0) {
+			::close(fd);
+			return false;
+		}
+		void *data = ::mmap(nullptr, sizeof(SharedStatusBlock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (data == MAP_FAILED)
+			return false;
+
+		m_block = static_cast<SharedStatusBlock *>(data);
+		m_block->magic = SharedStatusBlock::Magic;
+		m_block->version = SharedStatusBlock::Version;
+		if (m_block->sequence.load(std::memory_order_relaxed) & 1)
+			m_block->sequence.fetch_add(1, std::memory_order_release);  // previous owner died while updating
+		m_snapshot.events = snapshotWord(offsetof(StatusSnapshot, events));  // continue counting after a restart
+		return true;
+	}
+
+	void publish(const Status &status)
+	{
+		m_snapshot.status = status;
+		m_snapshot.timestampNs = steadyNowNs();
+		++m_snapshot.events;
+
+		uint64_t words[SharedStatusBlock::Words];
+		std::memcpy(words, &m_snapshot, sizeof words);
+
+		uint64_t sequence = m_block->sequence.load(std::memory_order_relaxed);
+		m_block->sequence.store(sequence + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		for (size_t i = 0; i < SharedStatusBlock::Words; ++i)
+			m_block->words[i].store(words[i], std::memory_order_relaxed);
+		m_block->sequence.store(sequence + 2, std::memory_order_release);
+	}
+
+	StatusLatencies & latencies()
+	{
+		return m_block->latencies;
+	}
+
+	// when the last job was written, 0 if no job was written since the last call
+	uint64_t takeJobWritten()
+	{
+		return m_block->jobWrittenNs.exchange(0, std::memory_order_acq_rel);
+	}
+
+private:
+	uint64_t snapshotWord(size_t offset) const
+	{
+		return m_block->words[offset / sizeof(uint64_t)].load(std::memory_order_relaxed);
+	}
+
+	SharedStatusBlock *m_block = nullptr;
+	StatusSnapshot m_snapshot;
+};
+
+class SharedStatusReader {
+public:
+	SharedStatusReader() = default;
+	SharedStatusReader(const SharedStatusReader &) = delete;
+	SharedStatusReader & operator=(const SharedStatusReader &) = delete;
+
+	~SharedStatusReader()
+	{
+		if (m_block)
+			::munmap(const_cast<SharedStatusBlock *>(m_block), sizeof(SharedStatusBlock));
+	}
+
+	bool open(const std::string &name)
+	{
+		int fd = ::shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+		if (fd < 0)
+			return false;
+		void *data = ::mmap(nullptr, sizeof(SharedStatusBlock), PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (data == MAP_FAILED)
+			return false;
+
+		m_block = static_cast<const SharedStatusBlock *>(data);
+		if (m_block->magic != SharedStatusBlock::Magic || m_block->version != SharedStatusBlock::Version) {
+			errno = EPROTO;
+			return false;
+		}
+		return true;
+	}
+
+	// false if the owner hasn't published anything yet (errno = ENODATA) or is stuck in an update (errno = EBUSY)
+	bool read(StatusSnapshot &snapshot) const
+	{
+		static const unsigned MaxAttempts = 1 << 20;
+
+		uint64_t words[SharedStatusBlock::Words];
+		for (unsigned attempt = 0;; ++attempt) {
+			if (attempt == MaxAttempts) {
+				errno = EBUSY;
+				return false;
+			}
+			uint64_t before = m_block->sequence.load(std::memory_order_acquire);
+			if (before & 1)
+				continue;
+			for (size_t i = 0; i < SharedStatusBlock::Words; ++i)
+				words[i] = m_block->words[i].load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (m_block->sequence.load(std::memory_order_relaxed) == before) {
+				if (before == 0) {
+					errno = ENODATA;
+					return false;
+				}
+				break;
+			}
+		}
+
+		std::memcpy(&snapshot, words, sizeof snapshot);
+		return true;
+	}
+
+	const StatusLatencies & latencies() const
+	{
+		return m_block->latencies;
+	}
+
+private:
+	const SharedStatusBlock *m_block = nullptr;
+};
+
+// called by a sender right after the last byte of a job reached the device, so the owner can time its completion
+inline bool markJobWritten(const std::string &name)
+{
+	int fd = ::shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0);
+	if (fd < 0)
+		return false;
+	void *data = ::mmap(nullptr, sizeof(SharedStatusBlock), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (data == MAP_FAILED)
+		return false;
+
+	auto block = static_cast<SharedStatusBlock *>(data);
+	bool ok = block->magic == SharedStatusBlock::Magic && block->version == SharedStatusBlock::Version;
+	if (ok)
+		block->jobWrittenNs.store(steadyNowNs(), std::memory_order_release);
+	else
+		errno = EPROTO;
+	::munmap(data, sizeof(SharedStatusBlock));
+
+	return ok;
+}
+
+}
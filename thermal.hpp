@@ -0,0 +1,111 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+
+
+namespace bp {
+
+// Estimates how hot a print head is from the raster lines it printed recently (an exponentially decaying sum, so a
+// duty cycle over roughly the last window) and learns from the printer's "cooling started" notifications how much
+// it takes before the printer pauses. Jobs can then be held back or sent elsewhere before that happens.
+class ThermalModel {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	static constexpr double SafetyFactor = 0.85;  // of the learned limit that is used
+	static constexpr double LearningRate = 0.3;
+
+	explicit ThermalModel(std::chrono::seconds window = std::chrono::seconds{60}, double limit = 0)
+		: m_window(std::chrono::duration<double>(window).count()), m_limit(limit)
+	{
+	}
+
+	double heat(Clock::time_point now) const
+	{
+		double elapsed = std::chrono::duration<double>(now - m_at).count();
+		return m_heat * std::exp(-std::max(elapsed, 0.0) / m_window);
+	}
+
+	// raster lines, 0 while nothing has been learned or configured
+	double limit() const
+	{
+		return m_limit;
+	}
+
+	bool isCooling() const
+	{
+		return m_cooling;
+	}
+
+	unsigned coolings() const
+	{
+		return m_coolings;
+	}
+
+	void addLines(uint64_t lines, Clock::time_point now)
+	{
+		m_heat = heat(now) + lines;
+		m_at = now;
+	}
+
+	void coolingStarted(Clock::time_point now)
+	{
+		if (m_cooling)
+			return;
+		m_cooling = true;
+		m_coolingSince = now;
+		++m_coolings;
+		double observed = heat(now);
+		m_limit = m_limit > 0 ? m_limit + LearningRate * (observed - m_limit) : observed;
+	}
+
+	void coolingFinished(Clock::time_point now)
+	{
+		if (!m_cooling)
+			return;
+		m_cooling = false;
+		double took = std::chrono::duration<double>(now - m_coolingSince).count();
+		m_coolingTime = m_coolingTime > 0 ? m_coolingTime + LearningRate * (took - m_coolingTime) : took;
+		// the head is cool enough again, whatever the estimate says
+		m_heat = std::min(heat(now), m_limit * SafetyFactor / 2);
+		m_at = now;
+	}
+
+	// how long to wait until lines more stay below the limit, zero if they can go right away or if waiting would take
+	// longer than letting the printer cool down by itself
+	Clock::duration delayFor(uint64_t lines, Clock::time_point now) const
+	{
+		if (m_limit <= 0)
+			return {};
+		double budget = m_limit * SafetyFactor;
+		double target = std::max(budget - lines, budget / 20);  // a job larger than the budget waits for a cool head
+		double current = heat(now);
+		if (current <= target)
+			return {};
+		double delay = m_window * std::log(current / target);
+		if (m_coolingTime > 0 && delay >= m_coolingTime)
+			return {};
+		return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(delay));
+	}
+
+	// share of the limit in use, 0 while the limit is unknown
+	double load(Clock::time_point now) const
+	{
+		return m_limit > 0 ? heat(now) / m_limit : 0;
+	}
+
+private:
+	double m_window;  // seconds
+	double m_limit;
+	double m_heat = 0;
+	Clock::time_point m_at = Clock::now();
+	bool m_cooling = false;
+	Clock::time_point m_coolingSince;
+	double m_coolingTime = 0;  // seconds, learned from the notifications
+	unsigned m_coolings = 0;
+};
+
+}
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+
+namespace bp {
+
+// Produces the results for indices 0 to count - 1 on a fixed set of worker threads and hands them out in index order.
+// Every worker has a queue of its own, filled round-robin, and takes work from the others once it runs dry. Only
+// indices less than window ahead of the next one to hand out are worked on, so a slow consumer holds the workers back
+// instead of results piling up in memory.
+template <class Result>
+class OrderedWorkerPool {
+public:
+	using Clock = std::chrono::steady_clock;
+	using Producer = std::function<Result(size_t index)>;
+
+	struct WorkerCounters {
+		size_t jobs = 0;
+		size_t stolen = 0;  // taken from another worker's queue
+		Clock::duration busy{};
+		Clock::duration blocked{};  // waiting for the consumer to make room in the window
+	};
+
+	struct Counters {
+		std::vector<WorkerCounters> workers;
+		size_t queueDepth = 0;  // results ready but not taken yet
+		size_t maxQueueDepth = 0;
+		Clock::duration consumerWait{};  // next() waiting for a result
+		Clock::duration elapsed{};
+
+		// share of the elapsed time the workers spent producing
+		double utilisation() const
+		{
+			if (workers.empty() || elapsed.count() <= 0)
+				return 0;
+			Clock::duration busy{};
+			for (const auto &worker : workers)
+				busy += worker.busy;
+			return std::chrono::duration<double>(busy).count() / std::chrono::duration<double>(elapsed).count() / workers.size();
+		}
+	};
+
+	OrderedWorkerPool(size_t count, Producer produce, size_t workers, size_t window)
+		: m_count(count), m_produce(std::move(produce)), m_window(std::max<size_t>(window, 1)), m_results(m_window)
+	{
+		workers = std::max<size_t>(workers, 1);
+		for (size_t w = 0; w < workers; ++w)
+			m_workers.push_back(std::make_unique<Worker>());
+		for (size_t i = 0; i < count; ++i)
+			m_workers[i % workers]->queue.push_back(i);
+		m_counters.workers.resize(workers);
+		m_start = Clock::now();
+		for (size_t w = 0; w < workers; ++w)
+			m_workers[w]->thread = std::thread{[this, w] { work(w); }};
+	}
+
+	OrderedWorkerPool(const OrderedWorkerPool &) = delete;
+	OrderedWorkerPool & operator=(const OrderedWorkerPool &) = delete;
+
+	~OrderedWorkerPool()
+	{
+		cancel();
+		for (auto &worker : m_workers)
+			worker->thread.join();
+	}
+
+	// the result for the next index, nullopt once all of them were handed out or the pool was cancelled
+	std::optional<Result> next()
+	{
+		std::unique_lock lock{m_mutex};
+		auto start = Clock::now();
+		m_ready.wait(lock, [this] { return m_cancelled || m_next == m_count || m_results[m_next % m_window]; });
+		m_counters.consumerWait += Clock::now() - start;
+		if (m_cancelled || m_next == m_count)
+			return std::nullopt;
+
+		auto &slot = m_results[m_next % m_window];
+		std::optional<Result> result = std::move(slot);
+		slot.reset();
+		++m_next;
+		--m_counters.queueDepth;
+		lock.unlock();
+		m_space.notify_all();
+		return result;
+	}
+
+	// workers finish what they are producing and stop, next() returns nullopt
+	void cancel()
+	{
+		{
+			std::lock_guard lock{m_mutex};
+			m_cancelled = true;
+		}
+		m_ready.notify_all();
+		m_space.notify_all();
+	}
+
+	Counters counters() const
+	{
+		std::lock_guard lock{m_mutex};
+		Counters counters = m_counters;
+		counters.elapsed = Clock::now() - m_start;
+		return counters;
+	}
+
+private:
+	struct Worker {
+		std::mutex mutex;
+		std::deque<size_t> queue;
+		std::thread thread;
+	};
+
+	// the front of the own queue, otherwise the lowest index at the front of any other queue: stealing the oldest
+	// work rather than the newest keeps the results close to the order they are handed out in
+	std::optional<size_t> take(size_t w, bool &stolen)
+	{
+		stolen = false;
+		{
+			std::lock_guard lock{m_workers[w]->mutex};
+			if (!m_workers[w]->queue.empty()) {
+				size_t index = m_workers[w]->queue.front();
+				m_workers[w]->queue.pop_front();
+				return index;
+			}
+		}
+
+		for (;;) {
+			Worker *victim = nullptr;
+			size_t lowest = SIZE_MAX;
+			for (auto &worker : m_workers) {
+				std::lock_guard lock{worker->mutex};
+				if (!worker->queue.empty() && worker->queue.front() < lowest) {
+					lowest = worker->queue.front();
+					victim = worker.get();
+				}
+			}
+			if (!victim)
+				return std::nullopt;
+
+			std::lock_guard lock{victim->mutex};
+			if (!victim->queue.empty() && victim->queue.front() == lowest) {
+				victim->queue.pop_front();
+				stolen = true;
+				return lowest;
+			}
+		}
+	}
+
+	void work(size_t w)
+	{
+		bool stolen;
+		while (auto index = take(w, stolen)) {
+			{
+				std::unique_lock lock{m_mutex};
+				auto start = Clock::now();
+				m_space.wait(lock, [this, &index] { return m_cancelled || *index < m_next + m_window; });
+				m_counters.workers[w].blocked += Clock::now() - start;
+				if (m_cancelled)
+					return;
+			}
+
+			auto start = Clock::now();
+			Result result = m_produce(*index);
+			auto busy = Clock::now() - start;
+
+			{
+				std::lock_guard lock{m_mutex};
+				m_results[*index % m_window] = std::move(result);
+				auto &counters = m_counters.workers[w];
+				++counters.jobs;
+				counters.stolen += stolen;
+				counters.busy += busy;
+				m_counters.maxQueueDepth = std::max(m_counters.maxQueueDepth, ++m_counters.queueDepth);
+			}
+			m_ready.notify_all();
+		}
+	}
+
+	size_t m_count;
+	Producer m_produce;
+	size_t m_window;
+	std::vector<std::unique_ptr<Worker>> m_workers;
+
+	mutable std::mutex m_mutex;
+	std::condition_variable m_ready;  // a result arrived, for the consumer
+	std::condition_variable m_space;  // the window moved on, for the workers
+	std::vector<std::optional<Result>> m_results;  // by index modulo window
+	size_t m_next = 0;
+	bool m_cancelled = false;
+	Counters m_counters;
+	Clock::time_point m_start;
+};
+
+}